@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "bmp_map.h"
+
+// One image of a batch, output is NULL until it is named
+typedef struct {
+    char *input;
+    char *output;
+} BATCH_ITEM;
+
+// Growing list of images
+typedef struct {
+    BATCH_ITEM *items;
+    int count;
+    int capacity;
+} BATCH_LIST;
+
+// Files of one image in flight and the job convolving them
+typedef struct {
+    BMP_MAP in;
+    BMP_MAP out;
+    CONV_JOB job;
+    int mapped;             // Both files are mapped
+    int ok;                 // Mapped and the job was queued
+} BATCH_SLOT;
+
+// Copy of the first length characters of text, NULL if out of memory
+static char *batch_strndup(const char *text, size_t length) {
+    char *copy = (char*)malloc(length + 1);
+    if (!copy) return NULL;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// dir/name, NULL if out of memory
+static char *batch_path(const char *dir, const char *name) {
+    size_t dir_length = strlen(dir);
+    size_t name_length = strlen(name);
+    int slash = dir_length > 0 && dir[dir_length - 1] != '/';
+    char *path = (char*)malloc(dir_length + slash + name_length + 1);
+    if (!path) return NULL;
+    memcpy(path, dir, dir_length);
+    if (slash) path[dir_length] = '/';
+    memcpy(path + dir_length + slash, name, name_length + 1);
+    return path;
+}
+
+// Append an image, takes ownership of input and output. Returns 1 on success.
+static int batch_add(BATCH_LIST *list, char *input, char *output) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        BATCH_ITEM *items = (BATCH_ITEM*)realloc(list->items, sizeof(BATCH_ITEM) * capacity);
+        if (!items) {
+            free(input);
+            free(output);
+            return 0;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count].input = input;
+    list->items[list->count].output = output;
+    list->count++;
+    return input != NULL;
+}
+
+// Free every name of the list
+static void batch_free(BATCH_LIST *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->items[i].input);
+        free(list->items[i].output);
+    }
+    free(list->items);
+}
+
+// 1 when name ends in .bmp, in any case
+static int batch_is_bmp(const char *name) {
+    size_t length = strlen(name);
+    if (length < 4) return 0;
+    const char *ext = name + length - 4;
+    return ext[0] == '.' && tolower((unsigned char)ext[1]) == 'b' &&
+           tolower((unsigned char)ext[2]) == 'm' && tolower((unsigned char)ext[3]) == 'p';
+}
+
+// Sort images by input name
+static int batch_compare(const void *a, const void *b) {
+    return strcmp(((const BATCH_ITEM*)a)->input, ((const BATCH_ITEM*)b)->input);
+}
+
+// Add the .bmp files of a directory in name order, returns 1 on success
+static int batch_read_directory(const char *dirname, BATCH_LIST *list) {
+    DIR *dir = opendir(dirname);
+    if (!dir) {
+        printf("Error: Failed to open directory %s.\n", dirname);
+        return 0;
+    }
+
+    int ok = 1;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || !batch_is_bmp(entry->d_name)) continue;
+        ok = batch_add(list, batch_path(dirname, entry->d_name), NULL);
+    }
+    closedir(dir);
+
+    if (!ok) printf("Error: Failed to allocate memory for batch.\n");
+    qsort(list->items, list->count, sizeof(BATCH_ITEM), batch_compare);
+    return ok;
+}
+
+// Add the images of a manifest, one "input [output]" per line, returns 1 on success
+static int batch_read_manifest(const char *filename, BATCH_LIST *list) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        printf("Error: Failed to open manifest %s.\n", filename);
+        return 0;
+    }
+
+    int ok = 1;
+    char line[4096];
+    for (int number = 1; ok && fgets(line, sizeof(line), file); number++) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        // Up to two names separated by blanks
+        char *names[3];
+        size_t lengths[3];
+        int count = 0;
+        for (char *p = line; *p && count < 3; ) {
+            while (isspace((unsigned char)*p)) p++;
+            if (!*p) break;
+            names[count] = p;
+            while (*p && !isspace((unsigned char)*p)) p++;
+            lengths[count] = (size_t)(p - names[count]);
+            count++;
+        }
+        if (count == 0) continue;
+        if (count > 2) {
+            printf("Error: Line %d of manifest has more than an input and an output.\n", number);
+            ok = 0;
+            break;
+        }
+
+        char *output = count == 2 ? batch_strndup(names[1], lengths[1]) : NULL;
+        ok = batch_add(list, batch_strndup(names[0], lengths[0]), output) && (count == 1 || output);
+        if (!ok) printf("Error: Failed to allocate memory for batch.\n");
+    }
+    fclose(file);
+    return ok;
+}
+
+// Map the input and create the output of one image, returns 1 on success.
+// The input is read into memory here, before its job starts.
+static int batch_open(const BATCH_ITEM *item, BATCH_SLOT *slot) {
+    slot->mapped = 0;
+    slot->ok = 0;
+
+    // Creating the output truncates it, so it must not be the input
+    struct stat in_stat, out_stat;
+    if (stat(item->input, &in_stat) == 0 && stat(item->output, &out_stat) == 0 &&
+        in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino) {
+        printf("Error: Output of %s would overwrite its input.\n", item->input);
+        return 0;
+    }
+
+    if (!bmp_map_read(item->input, &slot->in, BMP_MAP_POPULATE)) return 0;
+    if (!bmp_map_create(item->output, slot->in.image.width, slot->in.image.height, &slot->out, 0)) {
+        bmp_unmap(&slot->in);
+        return 0;
+    }
+    slot->mapped = 1;
+    return 1;
+}
+
+// Unmap both files of an image, returns 1 when the image was written
+static int batch_close(const BATCH_ITEM *item, BATCH_SLOT *slot) {
+    int ok = slot->ok;
+    if (slot->mapped) {
+        bmp_unmap(&slot->in);
+        if (!bmp_unmap(&slot->out)) ok = 0;
+        slot->mapped = 0;
+    }
+    if (!ok) printf("Error: Failed to convolve %s.\n", item->input);
+    return ok;
+}
+
+// Run a pipeline of kernels over every image of a batch, returns 1 when every image succeeded
+int conv_batch(const char *list, const char *out_dir, const KERNEL *kernels, int num_kernels,
+               const CONV_OPTIONS *options) {
+    struct stat st;
+    if (stat(list, &st) != 0) {
+        printf("Error: Failed to open batch %s.\n", list);
+        return 0;
+    }
+
+    BATCH_LIST batch = { NULL, 0, 0 };
+    int ok = S_ISDIR(st.st_mode) ? batch_read_directory(list, &batch) : batch_read_manifest(list, &batch);
+
+    // Name the outputs the manifest left out
+    for (int i = 0; ok && i < batch.count; i++) {
+        if (batch.items[i].output) continue;
+        if (!out_dir) {
+            printf("Error: %s has no output name and no output directory was given.\n", batch.items[i].input);
+            ok = 0;
+            break;
+        }
+        const char *slash = strrchr(batch.items[i].input, '/');
+        batch.items[i].output = batch_path(out_dir, slash ? slash + 1 : batch.items[i].input);
+        if (!batch.items[i].output) {
+            printf("Error: Failed to allocate memory for batch.\n");
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        batch_free(&batch);
+        return 0;
+    }
+
+    // Image i uses slot i % 2: while it is convolved the other slot closes
+    // image i - 1 and opens image i + 1
+    BATCH_SLOT slots[2];
+    int failed = 0;
+    if (batch.count > 0) batch_open(&batch.items[0], &slots[0]);
+    for (int i = 0; i < batch.count; i++) {
+        BATCH_SLOT *slot = &slots[i % 2];
+        BATCH_SLOT *other = &slots[(i + 1) % 2];
+
+        if (slot->mapped) {
+            slot->ok = conv_pipeline_submit(&slot->in.image, &slot->out.image, kernels, num_kernels, options,
+                                            &slot->job);
+        }
+        if (i > 0 && !batch_close(&batch.items[i - 1], other)) failed++;
+        if (i + 1 < batch.count) batch_open(&batch.items[i + 1], other);
+        if (slot->ok) slot->ok = conv_image_wait(&slot->job);
+    }
+    if (batch.count > 0 && !batch_close(&batch.items[batch.count - 1], &slots[(batch.count - 1) % 2])) failed++;
+
+    if (failed) printf("Error: %d of %d images failed.\n", failed, batch.count);
+    batch_free(&batch);
+    return failed == 0;
+}
@@ -0,0 +1,28 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "convolution.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Run a pipeline of kernels over every image of a batch in one process,
+// returns 1 when every image succeeded. list is either a directory, whose
+// .bmp files are convolved in name order, or a manifest file with one image
+// per line, "input [output]", and '#' comments. Images without an output
+// name are written to out_dir under their own file name.
+//
+// Files are mapped with bmp_map_read and bmp_map_create, so they must be
+// bottom-up 24-bit BMP files. With BACKEND_PTHREAD the calling thread maps
+// and reads image N + 1 and lets image N - 1 go to the disk while the pool
+// convolves image N. Threads come from the pool in options, and an image
+// that fails is reported and skipped.
+int conv_batch(const char *list, const char *out_dir, const KERNEL *kernels, int num_kernels,
+               const CONV_OPTIONS *options);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
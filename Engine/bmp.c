@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bmp.h"
+
+// Row size of a 24-bit BMP, padded to be a multiple of 4
+int bmp_row_size(int width) {
+    return (width * 3 + 3) & (~3);
+}
+
+// Allocate an image of the given size, returns 1 on success
+int image_alloc(IMAGE *img, int width, int height) {
+    img->width = width;
+    img->height = height;
+    img->row_padded = bmp_row_size(width);
+    img->data = (unsigned char*)calloc((size_t)img->row_padded * height, 1);
+
+    if (!img->data) {
+        printf("Error: Failed to allocate memory for image.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Free the pixel data of an image
+void image_free(IMAGE *img) {
+    free(img->data);
+    img->data = NULL;
+}
+
+// Read and check the headers of a 24-bit uncompressed BMP file, returns 1 on success
+int bmp_read_header(FILE *file, int *width, int *height, int *top_down) {
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+
+    if (fread(&fileHeader, sizeof(BITMAPFILEHEADER), 1, file) != 1 ||
+        fread(&infoHeader, sizeof(BITMAPINFOHEADER), 1, file) != 1 ||
+        fileHeader.bfType != 0x4D42) {
+        printf("Error: Not a BMP file.\n");
+        return 0;
+    }
+
+    if (infoHeader.biBitCount != 24 || infoHeader.biCompression != 0 || infoHeader.biWidth <= 0) {
+        printf("Error: Only uncompressed 24-bit BMP files are supported.\n");
+        return 0;
+    }
+
+    // Top-down images are stored with a negative height
+    *top_down = infoHeader.biHeight < 0;
+    *width = infoHeader.biWidth;
+    *height = *top_down ? -infoHeader.biHeight : infoHeader.biHeight;
+
+    fseek(file, fileHeader.bfOffBits, SEEK_SET);
+    return 1;
+}
+
+// Write the headers of a 24-bit BMP of the given size, returns 1 on success
+int bmp_write_header(FILE *file, int width, int height, int top_down) {
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+    uint32_t image_size = (uint32_t)bmp_row_size(width) * height;
+
+    fileHeader.bfType = 0x4D42;  // BM
+    fileHeader.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + image_size;
+    fileHeader.bfReserved1 = fileHeader.bfReserved2 = 0;
+    fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+
+    infoHeader.biSize = sizeof(BITMAPINFOHEADER);
+    infoHeader.biWidth = width;
+    infoHeader.biHeight = top_down ? -height : height;
+    infoHeader.biPlanes = 1;
+    infoHeader.biBitCount = 24;  // 24 bits per pixel
+    infoHeader.biCompression = 0;  // No compression
+    infoHeader.biSizeImage = image_size;
+    infoHeader.biXPelsPerMeter = 0;
+    infoHeader.biYPelsPerMeter = 0;
+    infoHeader.biClrUsed = 0;
+    infoHeader.biClrImportant = 0;
+
+    if (fwrite(&fileHeader, sizeof(BITMAPFILEHEADER), 1, file) != 1 ||
+        fwrite(&infoHeader, sizeof(BITMAPINFOHEADER), 1, file) != 1) {
+        printf("Error: Failed to write BMP header.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Load a 24-bit uncompressed BMP image, returns 1 on success
+int load_bmp(const char *filename, IMAGE *img) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        printf("Error: Failed to open BMP file.\n");
+        return 0;
+    }
+
+    int width, height, top_down;
+    if (!bmp_read_header(file, &width, &height, &top_down) || !image_alloc(img, width, height)) {
+        fclose(file);
+        return 0;
+    }
+
+    for (int i = 0; i < height; i++) {
+        // Keep rows bottom-up so that save_bmp writes the same picture back
+        int y = top_down ? height - 1 - i : i;
+        if (fread(IMAGE_ROW(img, y), 1, img->row_padded, file) != (size_t)img->row_padded) {
+            printf("Error: BMP file is truncated.\n");
+            image_free(img);
+            fclose(file);
+            return 0;
+        }
+    }
+
+    fclose(file);
+    return 1;
+}
+
+// Save an image as a 24-bit BMP, returns 1 on success
+int save_bmp(const char *filename, const IMAGE *img) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        printf("Error: Failed to save BMP file.\n");
+        return 0;
+    }
+
+    if (!bmp_write_header(file, img->width, img->height, 0)) {
+        fclose(file);
+        return 0;
+    }
+
+    // Write the image data, a full disk may only show when the file is closed
+    size_t bytes = (size_t)img->row_padded * img->height;
+    int written = fwrite(img->data, 1, bytes, file) == bytes;
+    if (fclose(file) != 0 || !written) {
+        printf("Error: Failed to save BMP file.\n");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,75 @@
+#ifndef BMP_H
+#define BMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t bfType;        // File type (should be 'BM')
+    uint32_t bfSize;        // Size of the file
+    uint16_t bfReserved1;
+    uint16_t bfReserved2;
+    uint32_t bfOffBits;     // Offset to the pixel data
+} BITMAPFILEHEADER;
+
+typedef struct {
+    uint32_t biSize;        // Size of the header
+    int32_t biWidth;        // Width of the image
+    int32_t biHeight;       // Height of the image (negative for top-down)
+    uint16_t biPlanes;
+    uint16_t biBitCount;    // Bits per pixel (24 for color)
+    uint32_t biCompression;
+    uint32_t biSizeImage;   // Image size
+    int32_t biXPelsPerMeter;
+    int32_t biYPelsPerMeter;
+    uint32_t biClrUsed;
+    uint32_t biClrImportant;
+} BITMAPINFOHEADER;
+#pragma pack(pop)
+
+// Image descriptor: 24-bit BGR pixels, rows kept in file order
+typedef struct {
+    int width;              // Image width in pixels
+    int height;             // Image height in pixels
+    int row_padded;         // Row size in bytes, padded to be a multiple of 4
+    unsigned char *data;    // height * row_padded bytes
+} IMAGE;
+
+// Pointer to the first byte of row y
+#define IMAGE_ROW(img, y) ((img)->data + (size_t)(y) * (img)->row_padded)
+
+// Row size of a 24-bit BMP, padded to be a multiple of 4
+int bmp_row_size(int width);
+
+// Allocate an image of the given size, returns 1 on success
+int image_alloc(IMAGE *img, int width, int height);
+
+// Free the pixel data of an image
+void image_free(IMAGE *img);
+
+// Read and check the headers of a 24-bit uncompressed BMP file. On success
+// returns 1, leaves the file at the first pixel row and sets top_down when
+// the rows are stored top to bottom.
+int bmp_read_header(FILE *file, int *width, int *height, int *top_down);
+
+// Write the headers of a 24-bit BMP of the given size, the pixel rows follow.
+// A top-down file has its rows stored top to bottom. Returns 1 on success.
+int bmp_write_header(FILE *file, int width, int height, int top_down);
+
+// Load a 24-bit uncompressed BMP image, returns 1 on success
+int load_bmp(const char *filename, IMAGE *img);
+
+// Save an image as a 24-bit BMP, returns 1 on success
+int save_bmp(const char *filename, const IMAGE *img);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bmp_map.h"
+
+// Function to map size bytes of fd and apply the hints, returns 1 on success
+static int bmp_map_file(BMP_MAP *map, size_t size, int writable, int hints) {
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (hints & BMP_MAP_POPULATE) flags |= MAP_POPULATE;
+#endif
+
+    map->map = mmap(NULL, size, prot, flags, map->fd, 0);
+    if (map->map == MAP_FAILED) {
+        printf("Error: Failed to map BMP file.\n");
+        map->map = NULL;
+        return 0;
+    }
+    map->size = size;
+
+    // The hints only change speed, so failures are ignored
+    if (hints & BMP_MAP_SEQUENTIAL) madvise(map->map, size, MADV_SEQUENTIAL);
+    if (hints & BMP_MAP_WILLNEED) madvise(map->map, size, MADV_WILLNEED);
+    return 1;
+}
+
+// Map a bottom-up 24-bit BMP file for reading, returns 1 on success
+int bmp_map_read(const char *filename, BMP_MAP *map, int hints) {
+    map->map = NULL;
+    map->fd = open(filename, O_RDONLY);
+    if (map->fd < 0) {
+        printf("Error: Failed to open BMP file.\n");
+        return 0;
+    }
+
+    FILE *file = fdopen(dup(map->fd), "rb");
+    int width = 0, height = 0, top_down = 0;
+    int ok = file && bmp_read_header(file, &width, &height, &top_down);
+    long offset = ok ? ftell(file) : 0;
+    if (file) fclose(file);
+
+    if (ok && top_down) {
+        printf("Error: Top-down BMP files cannot be mapped.\n");
+        ok = 0;
+    }
+
+    // The file must hold every row, padding included
+    struct stat st;
+    size_t row_padded = ok ? (size_t)bmp_row_size(width) : 0;
+    if (ok && (fstat(map->fd, &st) != 0 || (size_t)st.st_size < offset + row_padded * height)) {
+        printf("Error: BMP file is truncated.\n");
+        ok = 0;
+    }
+
+    if (!ok || !bmp_map_file(map, (size_t)st.st_size, 0, hints)) {
+        close(map->fd);
+        return 0;
+    }
+
+    map->image.width = width;
+    map->image.height = height;
+    map->image.row_padded = (int)row_padded;
+    map->image.data = (unsigned char*)map->map + offset;
+    return 1;
+}
+
+// Create a BMP file of the given size and map it for writing, returns 1 on success
+int bmp_map_create(const char *filename, int width, int height, BMP_MAP *map, int hints) {
+    map->map = NULL;
+    map->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (map->fd < 0) {
+        printf("Error: Failed to save BMP file.\n");
+        return 0;
+    }
+
+    size_t offset = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+    size_t size = offset + (size_t)bmp_row_size(width) * height;
+
+    // Write the headers through stdio, then size the file for the rows
+    FILE *file = fdopen(dup(map->fd), "wb");
+    int ok = file && bmp_write_header(file, width, height, 0);
+    if (file && fclose(file) != 0) ok = 0;
+    if (ok && ftruncate(map->fd, (off_t)size) != 0) {
+        printf("Error: Failed to size BMP file.\n");
+        ok = 0;
+    }
+
+    if (!ok || !bmp_map_file(map, size, 1, hints)) {
+        close(map->fd);
+        return 0;
+    }
+
+    map->image.width = width;
+    map->image.height = height;
+    map->image.row_padded = bmp_row_size(width);
+    map->image.data = (unsigned char*)map->map + offset;
+    return 1;
+}
+
+// Unmap a file and close it, returns 1 on success
+int bmp_unmap(BMP_MAP *map) {
+    int ok = 1;
+
+    if (map->map && munmap(map->map, map->size) != 0) ok = 0;
+    if (close(map->fd) != 0) ok = 0;
+    map->map = NULL;
+    map->image.data = NULL;
+
+    if (!ok) printf("Error: Failed to close mapped BMP file.\n");
+    return ok;
+}
@@ -0,0 +1,40 @@
+#ifndef BMP_MAP_H
+#define BMP_MAP_H
+
+#include "bmp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hints for bmp_map_read and bmp_map_create, combined with |
+#define BMP_MAP_POPULATE   1    // Fault every page in when mapping (MAP_POPULATE)
+#define BMP_MAP_SEQUENTIAL 2    // Rows are read once in order (MADV_SEQUENTIAL)
+#define BMP_MAP_WILLNEED   4    // Start reading the whole file ahead (MADV_WILLNEED)
+
+// BMP file mapped into memory. image.data points at the first pixel row in
+// the mapping (bfOffBits into the file) and image.row_padded is the stride
+// of the file, so rows are read and written in place without any copy.
+typedef struct {
+    IMAGE image;
+    void *map;              // Start of the mapping
+    size_t size;            // Bytes mapped, the whole file
+    int fd;
+} BMP_MAP;
+
+// Map a bottom-up 24-bit BMP file for reading, returns 1 on success.
+// Top-down files are refused, their rows are not in IMAGE order.
+int bmp_map_read(const char *filename, BMP_MAP *map, int hints);
+
+// Create a BMP file of the given size and map it for writing, returns 1 on
+// success. The headers are filled in, the pixel rows are left to the caller.
+int bmp_map_create(const char *filename, int width, int height, BMP_MAP *map, int hints);
+
+// Unmap a file and close it, written rows reach the file. Returns 1 on success.
+int bmp_unmap(BMP_MAP *map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
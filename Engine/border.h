@@ -0,0 +1,79 @@
+#ifndef BORDER_H
+#define BORDER_H
+
+// Border modes shared by every convolution engine: the CPU engine, the box
+// filter and the CUDA kernel all map pixels outside the image with
+// border_index, so they agree on what each mode means.
+
+#ifdef __CUDACC__
+#define BORDER_FN __host__ __device__ static inline
+#else
+#define BORDER_FN static inline
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// What the kernel reads for pixels outside the image, shown for a row abcd
+typedef enum {
+    BORDER_ZERO,            // 00|abcd|00
+    BORDER_CLAMP,           // aa|abcd|dd, the edge pixel is repeated (replicate)
+    BORDER_MIRROR,          // cb|abcd|cb, reflected about the edge pixel
+    BORDER_WRAP,            // cd|abcd|ab, the image tiles the plane
+    BORDER_REFLECT,         // ba|abcd|dc, reflected about the edge, which is repeated
+    BORDER_AVERAGE          // Taps outside are skipped and the rest reweighted to the full kernel sum
+} BORDER_MODE;
+
+#define BORDER_MODES 6
+
+// Index in [0, n) that position i of a row or column of n pixels reads under
+// a border mode, -1 when it reads nothing (BORDER_ZERO and BORDER_AVERAGE)
+BORDER_FN int border_index(int i, int n, BORDER_MODE border) {
+    if (i >= 0 && i < n) return i;
+
+    switch (border) {
+    case BORDER_CLAMP:
+        return i < 0 ? 0 : n - 1;
+
+    case BORDER_MIRROR: {
+        // Reflections repeat every 2n - 2 pixels, the edge pixels are not repeated
+        if (n == 1) return 0;
+        int period = 2 * (n - 1);
+        i %= period;
+        if (i < 0) i += period;
+        return i < n ? i : period - i;
+    }
+
+    case BORDER_REFLECT: {
+        // Reflections repeat every 2n pixels
+        int period = 2 * n;
+        i %= period;
+        if (i < 0) i += period;
+        return i < n ? i : period - 1 - i;
+    }
+
+    case BORDER_WRAP:
+        i %= n;
+        return i < 0 ? i + n : i;
+
+    case BORDER_ZERO:
+    case BORDER_AVERAGE:
+    default:
+        return -1;
+    }
+}
+
+// Factor that brings the weight of the taps inside the image, inside, back
+// to the weight of the whole kernel, total. BORDER_AVERAGE scales the sum of
+// a border pixel by it. A kernel whose inside taps sum to zero, such as an
+// edge detector at a corner, cannot be reweighted and keeps zero padding.
+BORDER_FN float border_average_scale(float total, float inside) {
+    return inside != 0.0f ? total / inside : 1.0f;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
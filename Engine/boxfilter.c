@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "boxfilter.h"
+
+// Sample color of pixel ix of a row, pixels outside it follow the border mode
+static inline uint32_t box_sample(const unsigned char *row, int ix, int width, int channels, int color,
+                                  BORDER_MODE border) {
+    if (ix < 0 || ix >= width) {
+        ix = border_index(ix, width, border);
+        if (ix < 0) return 0;
+    }
+    return row[ix * channels + color];
+}
+
+// Horizontal window sums of one input row for columns [x0, x1)
+static void box_sum_row(const unsigned char *row, uint32_t *out, int width, int channels, int radius,
+                        BORDER_MODE border, int x0, int x1) {
+    for (int color = 0; color < channels; color++) {
+        // Window [x0 - radius, x0 + radius]
+        uint32_t sum = 0;
+        for (int ix = x0 - radius; ix <= x0 + radius; ix++) {
+            sum += box_sample(row, ix, width, channels, color, border);
+        }
+
+        for (int x = x0; x < x1; x++) {
+            out[(x - x0) * channels + color] = sum;
+
+            // Slide the window one pixel to the right
+            sum -= box_sample(row, x - radius, width, channels, color, border);
+            sum += box_sample(row, x + radius + 1, width, channels, color, border);
+        }
+    }
+}
+
+// Box blur columns [x0, x1) of rows [y0, y1), pixels outside the image follow the border mode
+void box_blur_region(const unsigned char *src, unsigned char *dst, int stride,
+                     int width, int height, int channels, int radius, BORDER_MODE border,
+                     int x0, int y0, int x1, int y1) {
+    if (x1 <= x0 || y1 <= y0) return;
+
+    int span = (x1 - x0) * channels;
+    int window = 2 * radius + 1;
+
+    // Horizontal sums of the rows inside the vertical window, indexed by
+    // (row + window) % window as rows above the image are counted from -radius
+    uint32_t *ring = (uint32_t*)malloc(sizeof(uint32_t) * span * window);
+    uint32_t *column = (uint32_t*)calloc(span, sizeof(uint32_t));
+    if (!ring || !column) {
+        printf("Error: Failed to allocate memory for box blur.\n");
+        free(ring);
+        free(column);
+        return;
+    }
+
+    // Prime the vertical window with rows [y0 - radius, y0 + radius], rows that read nothing are skipped
+    for (int iy = y0 - radius; iy <= y0 + radius; iy++) {
+        int sy = border_index(iy, height, border);
+        if (sy < 0) continue;
+
+        uint32_t *sums = ring + (size_t)((iy + window) % window) * span;
+        box_sum_row(src + (size_t)sy * stride, sums, width, channels, radius, border, x0, x1);
+        for (int s = 0; s < span; s++) column[s] += sums[s];
+    }
+
+    for (int y = y0; y < y1; y++) {
+        // Number of surrounding rows inside the image
+        int top = y - radius < 0 ? 0 : y - radius;
+        int bottom = y + radius > height - 1 ? height - 1 : y + radius;
+        int rows = border == BORDER_AVERAGE ? bottom - top + 1 : window;
+
+        unsigned char *out = dst + (size_t)y * stride + x0 * channels;
+        for (int x = x0; x < x1; x++) {
+            int left = x - radius < 0 ? 0 : x - radius;
+            int right = x + radius > width - 1 ? width - 1 : x + radius;
+            uint64_t counter = (uint64_t)rows * (border == BORDER_AVERAGE ? right - left + 1 : window);
+
+            // take average, rounding half up like round() does for positive values
+            for (int color = 0; color < channels; color++) {
+                int s = (x - x0) * channels + color;
+                out[s] = (unsigned char)((2 * (uint64_t)column[s] + counter) / (2 * counter));
+            }
+        }
+
+        if (y + 1 == y1) break;
+
+        // Slide the window one row down: row y - radius leaves, row y + radius + 1 enters
+        if (border_index(y - radius, height, border) >= 0) {
+            uint32_t *sums = ring + (size_t)((y - radius + window) % window) * span;
+            for (int s = 0; s < span; s++) column[s] -= sums[s];
+        }
+        int enter = border_index(y + radius + 1, height, border);
+        if (enter >= 0) {
+            uint32_t *sums = ring + (size_t)((y + radius + 1) % window) * span;
+            box_sum_row(src + (size_t)enter * stride, sums, width, channels, radius, border, x0, x1);
+            for (int s = 0; s < span; s++) column[s] += sums[s];
+        }
+    }
+
+    free(ring);
+    free(column);
+}
+
+// Box blur a whole image, returns 1 on success
+int box_blur_image(const IMAGE *src, IMAGE *dst, int radius, BORDER_MODE border) {
+    if (src->width != dst->width || src->height != dst->height || src->row_padded != dst->row_padded) {
+        printf("Error: Source and destination images differ in size.\n");
+        return 0;
+    }
+
+    box_blur_region(src->data, dst->data, src->row_padded, src->width, src->height, 3, radius, border,
+                    0, 0, src->width, src->height);
+    return 1;
+}
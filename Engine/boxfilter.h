@@ -0,0 +1,32 @@
+#ifndef BOXFILTER_H
+#define BOXFILTER_H
+
+#include "bmp.h"
+#include "border.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Box blur of radius r: every output sample is the rounded average of the
+// (2r+1) x (2r+1) neighbourhood, with pixels outside the image read as the
+// border mode says. BORDER_AVERAGE counts only pixels inside the image.
+// Running sums make the cost per pixel independent of the radius.
+//
+// Blurs columns [x0, x1) of rows [y0, y1). src and dst share the row stride
+// (in bytes) and samples of a pixel are channels bytes apart. With
+// BORDER_ZERO and BORDER_AVERAGE src and dst may be the same buffer: input
+// rows are summed before they are overwritten. The other modes read rows
+// above the output row and must not run in place.
+void box_blur_region(const unsigned char *src, unsigned char *dst, int stride,
+                     int width, int height, int channels, int radius, BORDER_MODE border,
+                     int x0, int y0, int x1, int y1);
+
+// Box blur a whole image, returns 1 on success
+int box_blur_image(const IMAGE *src, IMAGE *dst, int radius, BORDER_MODE border);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
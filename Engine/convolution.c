@@ -0,0 +1,927 @@
+#define _GNU_SOURCE  // sched_getaffinity and CPU_COUNT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "convolution.h"
+#include "convolution_simd.h"
+#include "convolution_fixed.h"
+#include "convolution_fft.h"
+#include "kernel_file.h"
+#include "planar.h"
+
+// Window of rows the row kernels run on: interleaved BGR rows (channels 3)
+// or one plane of a planar image (channels 1). Row y of the full image,
+// for the rows the window holds, starts at data + (y - first_row) * stride.
+typedef struct {
+    int width;
+    int height;             // Height of the full image, rows outside it follow the border mode
+    int channels;
+    int first_row;
+    size_t stride;
+    unsigned char *data;
+} SURFACE;
+
+// Tile height limits of conv_rows, and the L2 size assumed when it is unknown
+#define CONV_MIN_TILE_ROWS 16
+#define CONV_MAX_TILE_ROWS 256
+#define CONV_DEFAULT_L2 (256 * 1024)
+
+// Row bands queued per pool thread, the spare bands are what idle threads steal
+#define CONV_BANDS_PER_THREAD 4
+
+#define SURFACE_ROW(s, y) ((s)->data + (size_t)((y) - (s)->first_row) * (s)->stride)
+
+// Buffers of one thread kept across tiles, bands and images, so a batch of
+// small images does not allocate them for every band. They grow to the
+// largest size the thread has needed and are freed when the thread exits.
+typedef struct {
+    unsigned char *tiles[2];    // Ping-pong planes of conv_pipeline_rows
+    size_t tile_bytes;          // Size of each of them
+    unsigned char *ring;        // Horizontal results of conv_rows_separable
+    size_t ring_bytes;
+} CONV_SCRATCH;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void conv_scratch_free(void *arg) {
+    CONV_SCRATCH *scratch = (CONV_SCRATCH*)arg;
+    free(scratch->tiles[0]);
+    free(scratch->tiles[1]);
+    free(scratch->ring);
+    free(scratch);
+}
+
+static void conv_scratch_key(void) {
+    pthread_key_create(&scratch_key, conv_scratch_free);
+}
+
+// Scratch buffers of the calling thread, NULL if out of memory
+static CONV_SCRATCH *conv_scratch(void) {
+    pthread_once(&scratch_once, conv_scratch_key);
+    CONV_SCRATCH *scratch = (CONV_SCRATCH*)pthread_getspecific(scratch_key);
+    if (!scratch) {
+        scratch = (CONV_SCRATCH*)calloc(1, sizeof(CONV_SCRATCH));
+        if (scratch && pthread_setspecific(scratch_key, scratch) != 0) {
+            free(scratch);
+            scratch = NULL;
+        }
+    }
+    return scratch;
+}
+
+// Point a ping-pong pair of width x height planes at the thread's tile
+// buffers, growing them when needed. Returns 1 on success.
+static int conv_scratch_pingpong(PLANAR_PINGPONG *pair, int width, int height) {
+    CONV_SCRATCH *scratch = conv_scratch();
+    if (!scratch) {
+        printf("Error: Failed to allocate memory for planar image.\n");
+        return 0;
+    }
+
+    int stride = (width + 63) & (~63);
+    size_t bytes = (size_t)stride * height * PLANAR_CHANNELS;
+    if (bytes > scratch->tile_bytes) {
+        for (int i = 0; i < 2; i++) {
+            free(scratch->tiles[i]);
+            scratch->tiles[i] = (unsigned char*)malloc(bytes);
+        }
+        scratch->tile_bytes = scratch->tiles[0] && scratch->tiles[1] ? bytes : 0;
+        if (!scratch->tile_bytes) {
+            printf("Error: Failed to allocate memory for planar image.\n");
+            return 0;
+        }
+    }
+
+    pair->current = 0;
+    for (int i = 0; i < 2; i++) {
+        pair->buffers[i].width = width;
+        pair->buffers[i].height = height;
+        pair->buffers[i].stride = stride;
+        pair->buffers[i].data = scratch->tiles[i];
+    }
+    return 1;
+}
+
+// The thread's ring of at least bytes bytes, NULL if out of memory
+static unsigned char *conv_scratch_ring(size_t bytes) {
+    CONV_SCRATCH *scratch = conv_scratch();
+    if (!scratch) return NULL;
+    if (bytes > scratch->ring_bytes) {
+        free(scratch->ring);
+        scratch->ring = (unsigned char*)malloc(bytes);
+        scratch->ring_bytes = scratch->ring ? bytes : 0;
+    }
+    return scratch->ring;
+}
+
+// Fill options with the defaults (serial backend, float precision, zero border, automatic method and tiles)
+void conv_default_options(CONV_OPTIONS *options) {
+    options->backend = BACKEND_SERIAL;
+    options->num_threads = 0;
+    options->precision = PRECISION_FLOAT;
+    options->border = BORDER_ZERO;
+    options->method = METHOD_AUTO;
+    options->tile_width = 0;
+    options->tile_height = 0;
+    options->pool = NULL;
+}
+
+// Options to use when the caller passes NULL
+static const CONV_OPTIONS *conv_options_or_default(const CONV_OPTIONS *options) {
+    static const CONV_OPTIONS defaults = { BACKEND_SERIAL, 0, PRECISION_FLOAT, BORDER_ZERO, METHOD_AUTO, 0, 0, NULL };
+    return options ? options : &defaults;
+}
+
+// Split a kernel into column x row factors when it has rank 1
+static void kernel_detect_separable(KERNEL *kernel) {
+    int width = kernel->width;
+    int height = kernel->height;
+    const float *k = kernel->values;
+
+    kernel->separable = 0;
+    kernel->column = NULL;
+    kernel->row = NULL;
+    if (width == 1 || height == 1) return;  // Already a single pass
+
+    // Pivot on the largest coefficient: column = its column, row = its row / pivot
+    int pivot = 0;
+    for (int i = 1; i < width * height; i++) {
+        if (fabsf(k[i]) > fabsf(k[pivot])) pivot = i;
+    }
+    float max_value = fabsf(k[pivot]);
+    if (max_value == 0.0f) return;
+
+    int py = pivot / width;
+    int px = pivot % width;
+    float *column = (float*)malloc(sizeof(float) * height);
+    float *row = (float*)malloc(sizeof(float) * width);
+    if (!column || !row) {
+        free(column);
+        free(row);
+        return;
+    }
+
+    for (int y = 0; y < height; y++) column[y] = k[y * width + px];
+    for (int x = 0; x < width; x++) row[x] = k[py * width + x] / k[pivot];
+
+    // The kernel has rank 1 when every coefficient is reproduced by the outer product
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (fabsf(column[y] * row[x] - k[y * width + x]) > 1e-6f * max_value) {
+                free(column);
+                free(row);
+                return;
+            }
+        }
+    }
+
+    kernel->separable = 1;
+    kernel->column = column;
+    kernel->row = row;
+}
+
+// Copy width * height coefficients into a kernel, detect whether it is
+// separable and quantize it for PRECISION_FIXED, returns 1 on success
+int kernel_init(KERNEL *kernel, int width, int height, const float *values) {
+    if (width <= 0 || height <= 0 || width % 2 == 0 || height % 2 == 0) {
+        printf("Error: Kernel size must be odd.\n");
+        return 0;
+    }
+
+    kernel->width = width;
+    kernel->height = height;
+    kernel->values = (float*)malloc(sizeof(float) * width * height);
+    if (!kernel->values) {
+        printf("Error: Failed to allocate memory for kernel.\n");
+        return 0;
+    }
+
+    memcpy(kernel->values, values, sizeof(float) * width * height);
+    kernel_detect_separable(kernel);
+    kernel_quantize(kernel);
+    kernel_classify(kernel);
+    kernel_group_taps(kernel);
+    return 1;
+}
+
+// kernel_init with a kernel read from a file or from spec itself
+int kernel_load(KERNEL *kernel, const char *spec) {
+    int width, height;
+    float *values;
+    if (!kernel_read(spec, &width, &height, &values)) {
+        return 0;
+    }
+
+    int ok = kernel_init(kernel, width, height, values);
+    free(values);
+    return ok;
+}
+
+// Free the coefficients of a kernel
+void kernel_free(KERNEL *kernel) {
+    free(kernel->values);
+    free(kernel->column);
+    free(kernel->row);
+    free(kernel->fixed);
+    free(kernel->fixed_column);
+    free(kernel->fixed_row);
+    free(kernel->fixed_order);
+    free(kernel->fixed_bounds);
+    free(kernel->fixed_pairs);
+    kernel->values = NULL;
+    kernel->column = NULL;
+    kernel->row = NULL;
+    kernel->fixed = NULL;
+    kernel->fixed_column = NULL;
+    kernel->fixed_row = NULL;
+    kernel->fixed_order = NULL;
+    kernel->fixed_bounds = NULL;
+    kernel->fixed_pairs = NULL;
+}
+
+// Convolve one pixel near the edge of the image, taps outside it follow the border mode
+static void conv_pixel_border(const unsigned char *const *rows, unsigned char *out, int width, int channels,
+                              int x, const KERNEL *kernel, BORDER_MODE border) {
+    int radius_x = kernel->width / 2;
+
+    // BORDER_AVERAGE reweights the taps inside the image to the whole kernel
+    float scale = 1.0f;
+    if (border == BORDER_AVERAGE) {
+        float total = 0.0f, inside = 0.0f;
+        for (int i = 0; i < kernel->width * kernel->height; i++) {
+            int ix = x + i % kernel->width - radius_x;
+            total += kernel->values[i];
+            if (rows[i / kernel->width] && ix >= 0 && ix < width) inside += kernel->values[i];
+        }
+        scale = border_average_scale(total, inside);
+    }
+
+    for (int color = 0; color < channels; color++) {
+        float sum = 0.0f;
+
+        // Apply the kernel
+        for (int ky = 0; ky < kernel->height; ky++) {
+            const unsigned char *row = rows[ky];
+            if (!row) continue;  // Zero padding above and below the image
+
+            const float *k = kernel->values + ky * kernel->width;
+            for (int kx = 0; kx < kernel->width; kx++) {
+                int ix = border_index(x + kx - radius_x, width, border);
+                if (ix < 0) continue;  // Zero padding left and right
+
+                sum = fmaf(row[ix * channels + color], k[kx], sum);
+            }
+        }
+        sum *= scale;
+
+        // Clamp the value to ensure it's within the valid range [0, 255]
+        sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+        out[x * channels + color] = (unsigned char)sum;
+    }
+}
+
+// Convolve columns [x_begin, x_end) of one output row
+void conv_row(const unsigned char *const *rows, unsigned char *out, int width, int channels,
+              int x_begin, int x_end, const KERNEL *kernel, const CONV_OPTIONS *options) {
+    int radius_x = kernel->width / 2;
+    options = conv_options_or_default(options);
+    int fixed = options->precision == PRECISION_FIXED;
+    void (*border)(const unsigned char *const *, unsigned char *, int, int, int, const KERNEL *, BORDER_MODE) =
+        fixed ? conv_pixel_border_fixed : conv_pixel_border;
+    CONV_SAMPLES_FN interior = fixed ? conv_samples_fixed_dispatch() : conv_samples_dispatch(kernel);
+
+    // Interior pixels [inner_begin, inner_end) have every tap inside the row
+    int inner_begin = radius_x > x_begin ? radius_x : x_begin;
+    int inner_end = width - radius_x < x_end ? width - radius_x : x_end;
+    if (inner_begin > x_end) inner_begin = x_end;
+    if (inner_end < inner_begin) inner_end = inner_begin;
+
+    // Rows outside the image change the weights of every pixel under BORDER_AVERAGE
+    for (int ky = 0; ky < kernel->height && options->border == BORDER_AVERAGE; ky++) {
+        if (!rows[ky]) inner_begin = inner_end = x_end;
+    }
+
+    for (int x = x_begin; x < inner_begin; x++) {
+        border(rows, out, width, channels, x, kernel, options->border);
+    }
+
+    interior(rows, out, inner_begin * channels, inner_end * channels, channels, kernel);
+
+    for (int x = inner_end; x < x_end; x++) {
+        border(rows, out, width, channels, x, kernel, options->border);
+    }
+}
+
+// Horizontal pass for one pixel near the left or right edge
+static void conv_pixel_horizontal(const unsigned char *row, float *out, int width, int channels, int x,
+                                  const KERNEL *kernel, BORDER_MODE border) {
+    int radius_x = kernel->width / 2;
+
+    // BORDER_AVERAGE reweights the row factors, the vertical pass does the same for the column
+    float scale = 1.0f;
+    if (border == BORDER_AVERAGE) {
+        float total = 0.0f, inside = 0.0f;
+        for (int kx = 0; kx < kernel->width; kx++) {
+            int ix = x + kx - radius_x;
+            total += kernel->row[kx];
+            if (ix >= 0 && ix < width) inside += kernel->row[kx];
+        }
+        scale = border_average_scale(total, inside);
+    }
+
+    for (int color = 0; color < channels; color++) {
+        float sum = 0.0f;
+        for (int kx = 0; kx < kernel->width; kx++) {
+            int ix = border_index(x + kx - radius_x, width, border);
+            if (ix < 0) continue;  // Zero padding left and right
+
+            sum += row[ix * channels + color] * kernel->row[kx];
+        }
+        out[x * channels + color] = sum * scale;
+    }
+}
+
+// Horizontal pass of a separable kernel over columns [x_begin, x_end) of one input row
+static void conv_row_horizontal(const unsigned char *row, float *out, int width, int channels,
+                                int x_begin, int x_end, const KERNEL *kernel, BORDER_MODE border) {
+    int radius_x = kernel->width / 2;
+    int inner_begin = radius_x > x_begin ? radius_x : x_begin;
+    int inner_end = width - radius_x < x_end ? width - radius_x : x_end;
+    if (inner_begin > x_end) inner_begin = x_end;
+    if (inner_end < inner_begin) inner_end = inner_begin;
+
+    for (int x = x_begin; x < inner_begin; x++) {
+        conv_pixel_horizontal(row, out, width, channels, x, kernel, border);
+    }
+
+    // Interior pixels have every tap inside the row
+    for (int s = inner_begin * channels; s < inner_end * channels; s++) {
+        const unsigned char *in = row + s - radius_x * channels;
+        float sum = 0.0f;
+        for (int kx = 0; kx < kernel->width; kx++) {
+            sum += in[kx * channels] * kernel->row[kx];
+        }
+        out[s] = sum;
+    }
+
+    for (int x = inner_end; x < x_end; x++) {
+        conv_pixel_horizontal(row, out, width, channels, x, kernel, border);
+    }
+}
+
+// Vertical pass of a separable kernel over samples [s_begin, s_end), rows[ky] is NULL for zero rows
+static void conv_row_vertical(const float *const *rows, unsigned char *out, int s_begin, int s_end,
+                              const KERNEL *kernel, BORDER_MODE border) {
+    float scale = 1.0f;
+    if (border == BORDER_AVERAGE) {
+        float total = 0.0f, inside = 0.0f;
+        for (int ky = 0; ky < kernel->height; ky++) {
+            total += kernel->column[ky];
+            if (rows[ky]) inside += kernel->column[ky];
+        }
+        scale = border_average_scale(total, inside);
+    }
+
+    for (int s = s_begin; s < s_end; s++) {
+        float sum = 0.0f;
+        for (int ky = 0; ky < kernel->height; ky++) {
+            if (rows[ky]) sum += rows[ky][s] * kernel->column[ky];
+        }
+        sum *= scale;
+
+        // Clamp the value to ensure it's within the valid range [0, 255]
+        sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+        out[s] = (unsigned char)sum;
+    }
+}
+
+// Separable path: horizontal results are kept in a ring of kernel->height rows.
+// Float and fixed-point results are both 4 bytes per sample. Rows outside the
+// image map to rows within the kernel radius, which the ring holds, for
+// every border mode but BORDER_WRAP. Returns 0 if memory runs out.
+static int conv_rows_separable(const SURFACE *src, SURFACE *dst, const KERNEL *kernel, int fixed,
+                               BORDER_MODE border, int start_row, int end_row, int x_begin, int x_end) {
+    int radius_y = kernel->height / 2;
+    int channels = src->channels;
+    size_t row_bytes = (size_t)src->width * channels * 4;
+    unsigned char *ring = conv_scratch_ring(row_bytes * kernel->height);
+    const void **rows = (const void**)malloc(sizeof(*rows) * kernel->height);
+    if (!ring || !rows) {
+        printf("Error: Failed to allocate memory for separable rows.\n");
+        free(rows);
+        return 0;
+    }
+
+    // Next input row that still needs its horizontal pass
+    int next_row = start_row - radius_y < 0 ? 0 : start_row - radius_y;
+
+    for (int y = start_row; y < end_row; y++) {
+        int last = y + radius_y < src->height - 1 ? y + radius_y : src->height - 1;
+        for (; next_row <= last; next_row++) {
+            void *slot = ring + (next_row % kernel->height) * row_bytes;
+            if (fixed) {
+                conv_row_horizontal_fixed(SURFACE_ROW(src, next_row), (int32_t*)slot, src->width, channels,
+                                          x_begin, x_end, kernel, border);
+            } else {
+                conv_row_horizontal(SURFACE_ROW(src, next_row), (float*)slot, src->width, channels,
+                                    x_begin, x_end, kernel, border);
+            }
+        }
+
+        for (int ky = 0; ky < kernel->height; ky++) {
+            int iy = border_index(y + ky - radius_y, src->height, border);
+            rows[ky] = iy < 0 ? NULL : ring + (iy % kernel->height) * row_bytes;
+        }
+
+        if (fixed) {
+            conv_row_vertical_fixed((const int32_t *const *)rows, SURFACE_ROW(dst, y),
+                                    x_begin * channels, x_end * channels, kernel, border);
+        } else {
+            conv_row_vertical((const float *const *)rows, SURFACE_ROW(dst, y),
+                              x_begin * channels, x_end * channels, kernel, border);
+        }
+    }
+
+    free(rows);
+    return 1;
+}
+
+// conv_surface_rows with FFT blocks, returns 0 without writing anything if memory runs out
+static int conv_surface_rows_fft(const SURFACE *src, SURFACE *dst, const KERNEL *kernel, BORDER_MODE border,
+                                 int start_row, int end_row, int x_begin, int x_end) {
+    int radius_y = kernel->height / 2;
+    int num_rows = end_row - start_row;
+    const unsigned char **rows = (const unsigned char**)malloc(sizeof(*rows) * (num_rows + kernel->height - 1));
+    unsigned char **out = (unsigned char**)malloc(sizeof(*out) * num_rows);
+    int ok = rows && out;
+
+    // Input row i is image row start_row - radius_y + i, NULL for zero rows
+    for (int i = 0; ok && i < num_rows + kernel->height - 1; i++) {
+        int iy = border_index(start_row - radius_y + i, src->height, border);
+        rows[i] = iy < 0 ? NULL : SURFACE_ROW(src, iy);
+    }
+    for (int i = 0; ok && i < num_rows; i++) {
+        out[i] = SURFACE_ROW(dst, start_row + i);
+    }
+
+    ok = ok && conv_fft_rows(rows, out, num_rows, src->width, src->channels, x_begin, x_end, kernel, border);
+    free(rows);
+    free(out);
+    return ok;
+}
+
+// Convolve columns [x_begin, x_end) of rows [start_row, end_row) of a surface.
+// src must hold the rows within the kernel radius of them and the rows those
+// map to outside the image, dst must hold the rows themselves. Columns outside
+// the surface follow the border mode, so a surface cut from a wider image
+// must include the columns within the kernel radius. Returns 0 if memory runs out.
+static int conv_surface_rows(const SURFACE *src, SURFACE *dst, const KERNEL *kernel, const CONV_OPTIONS *options,
+                             int start_row, int end_row, int x_begin, int x_end) {
+    options = conv_options_or_default(options);
+    int fixed = options->precision == PRECISION_FIXED;
+
+    // Large kernels are cheaper with FFT blocks, fixed point keeps its exact sums
+    if (!fixed && (options->method == METHOD_FFT ||
+                   (options->method == METHOD_AUTO && conv_fft_faster(kernel, end_row - start_row, x_end - x_begin))) &&
+        conv_surface_rows_fft(src, dst, kernel, options->border, start_row, end_row, x_begin, x_end)) {
+        return 1;
+    }
+
+    // Fixed point needs the quantized factors, they are missing for extreme kernels
+    if (kernel->separable && (!fixed || kernel->fixed_row) && options->border != BORDER_WRAP) {
+        return conv_rows_separable(src, dst, kernel, fixed, options->border, start_row, end_row, x_begin, x_end);
+    }
+
+    int radius_y = kernel->height / 2;
+    const unsigned char **rows = (const unsigned char**)malloc(sizeof(*rows) * kernel->height);
+    if (!rows) {
+        printf("Error: Failed to allocate memory for kernel rows.\n");
+        return 0;
+    }
+
+    for (int y = start_row; y < end_row; y++) {
+        // Point each kernel row at the input row it reads, NULL for zero rows
+        for (int ky = 0; ky < kernel->height; ky++) {
+            int iy = border_index(y + ky - radius_y, src->height, options->border);
+            rows[ky] = iy < 0 ? NULL : SURFACE_ROW(src, iy);
+        }
+
+        conv_row(rows, SURFACE_ROW(dst, y), src->width, src->channels, x_begin, x_end, kernel, options);
+    }
+
+    free(rows);
+    return 1;
+}
+
+// Surface for the first width columns of plane c, whose row 0 is image row first_row
+static SURFACE plane_surface(const PLANAR *planar, int c, int width, int first_row, int image_height) {
+    SURFACE surface;
+    surface.width = width;
+    surface.height = image_height;
+    surface.channels = 1;
+    surface.first_row = first_row;
+    surface.stride = planar->stride;
+    surface.data = PLANAR_ROW(planar, c, 0);
+    return surface;
+}
+
+// Convolve rows [start_row, end_row) of every plane of src into dst, returns 1 on success
+int conv_planar_rows(const PLANAR *src, PLANAR *dst, const KERNEL *kernel, const CONV_OPTIONS *options,
+                     int start_row, int end_row) {
+    for (int c = 0; c < PLANAR_CHANNELS; c++) {
+        SURFACE in = plane_surface(src, c, src->width, 0, src->height);
+        SURFACE out = plane_surface(dst, c, src->width, 0, src->height);
+        if (!conv_surface_rows(&in, &out, kernel, options, start_row, end_row, 0, src->width)) return 0;
+    }
+    return 1;
+}
+
+// Size of the L2 cache in bytes, CONV_DEFAULT_L2 when it cannot be detected
+static long conv_l2_cache_size(void) {
+    static long l2_size = -1;  // -1 until the system has been asked
+    if (l2_size > 0) return l2_size;
+
+    long size = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (size <= 0) {
+        // Linux without the glibc extension, e.g. "1024K"
+        FILE *file = fopen("/sys/devices/system/cpu/cpu0/cache/index2/size", "r");
+        if (file) {
+            char unit = 'K';
+            if (fscanf(file, "%ld%c", &size, &unit) >= 1) {
+                size *= unit == 'M' ? 1024 * 1024 : (unit == 'K' ? 1024 : 1);
+            }
+            fclose(file);
+        }
+    }
+
+    l2_size = size > 0 ? size : CONV_DEFAULT_L2;
+    return l2_size;
+}
+
+// Halo of a pipeline: the radii of all its kernels added up
+static void conv_pipeline_halo(const KERNEL *kernels, int num_kernels, int *halo_x, int *halo_y) {
+    *halo_x = 0;
+    *halo_y = 0;
+    for (int k = 0; k < num_kernels; k++) {
+        *halo_x += kernels[k].width / 2;
+        *halo_y += kernels[k].height / 2;
+    }
+}
+
+// Bytes conv_pipeline_rows keeps per buffer column of a tile: two sets of
+// planes holding the tile with its halo rows, and the ring of the tallest
+// separable kernel
+static size_t conv_tile_column_bytes(int tile_height, const KERNEL *kernels, int num_kernels) {
+    int halo_x, halo_y;
+    conv_pipeline_halo(kernels, num_kernels, &halo_x, &halo_y);
+
+    size_t ring = 0;
+    for (int k = 0; k < num_kernels; k++) {
+        if (kernels[k].separable && (size_t)kernels[k].height * 4 > ring) ring = (size_t)kernels[k].height * 4;
+    }
+    return PLANAR_CHANNELS * 2 * ((size_t)tile_height + 2 * halo_y) + ring;
+}
+
+// Tile size for conv_pipeline_rows. Tiles span the full width while at least
+// CONV_MIN_TILE_ROWS rows fit in half of the L2 cache, wide images are cut
+// into column tiles as well. Sizes set in options override the automatic ones.
+static void conv_tile_size(int width, const KERNEL *kernels, int num_kernels, const CONV_OPTIONS *options,
+                           int *tile_width, int *tile_height) {
+    size_t budget = (size_t)conv_l2_cache_size() / 2;
+    int halo_x, halo_y;
+    conv_pipeline_halo(kernels, num_kernels, &halo_x, &halo_y);
+    halo_x *= 2;
+
+    *tile_width = width;
+    if (options->tile_width > 0) {
+        *tile_width = options->tile_width < width ? options->tile_width : width;
+    } else if ((size_t)(width + halo_x) * conv_tile_column_bytes(CONV_MIN_TILE_ROWS, kernels, num_kernels) > budget) {
+        // Widest multiple of 64 columns that fits with the minimum height
+        long columns = (long)(budget / conv_tile_column_bytes(CONV_MIN_TILE_ROWS, kernels, num_kernels)) - halo_x;
+        *tile_width = columns < 64 ? 64 : (int)(columns & ~63L);
+    }
+
+    if (options->tile_height > 0) {
+        *tile_height = options->tile_height;
+        return;
+    }
+
+    // Grow the tile downwards while it still fits, fewer tiles mean less halo work
+    *tile_height = CONV_MIN_TILE_ROWS;
+    while (*tile_height < CONV_MAX_TILE_ROWS &&
+           (size_t)(*tile_width + halo_x) * conv_tile_column_bytes(*tile_height * 2, kernels, num_kernels) <= budget) {
+        *tile_height *= 2;
+    }
+}
+
+// Split image pixels [x0, x1) x [y0, y1) into planar column x - x0, row y - y0,
+// pixels outside the image wrap around to the opposite edge
+static void image_to_planar_wrapped(const IMAGE *src, PLANAR *planar, int x0, int y0, int x1, int y1) {
+    for (int y = y0; y < y1; y++) {
+        int sy = border_index(y, src->height, BORDER_WRAP);
+
+        // Copy the row in runs that do not cross the right edge of the image
+        for (int x = x0; x < x1; ) {
+            int sx = border_index(x, src->width, BORDER_WRAP);
+            int run = src->width - sx < x1 - x ? src->width - sx : x1 - x;
+            PLANAR part = *planar;
+            part.data += (size_t)(y - y0) * part.stride + (x - x0);
+            image_to_planar_tile(src, &part, sx, sy, sx + run, sy + 1);
+            x += run;
+        }
+    }
+}
+
+// Run a list of kernels over rows [start_row, end_row) of src, writing the
+// result of the last one into dst. The rows are cut into tiles that fit in the
+// L2 cache. Each tile is split into planes with the halo of the whole
+// pipeline, then every stage convolves the region the stages after it still
+// need, ping-ponging between two planar buffers, and the last stage's tile is
+// merged into dst. Intermediate images never leave the cache.
+//
+// Tiles stop at the image edges, where the row kernels apply the border
+// mode to each stage's input. Wrapped borders read the opposite edge, which a
+// tile does not hold, but convolution commutes with wrapping the image, so a
+// wrapped tile is instead split with its full halo read around the edges and
+// the stages run on it as if it were the whole image. Returns 0 if memory
+// runs out.
+int conv_pipeline_rows(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                       const CONV_OPTIONS *options, int start_row, int end_row) {
+    if (start_row >= end_row || num_kernels <= 0) return 1;
+
+    options = conv_options_or_default(options);
+    int wrap = options->border == BORDER_WRAP;
+    CONV_OPTIONS stage_options = *options;
+    if (wrap) stage_options.border = BORDER_ZERO;  // Never reached, the buffers hold every tap
+
+    int halo_x, halo_y;
+    conv_pipeline_halo(kernels, num_kernels, &halo_x, &halo_y);
+    int tile_width, tile_height;
+    conv_tile_size(src->width, kernels, num_kernels, options, &tile_width, &tile_height);
+    if (tile_height > end_row - start_row) tile_height = end_row - start_row;
+
+    int buffer_width = tile_width + 2 * halo_x;
+    if (!wrap && buffer_width > src->width) buffer_width = src->width;
+    PLANAR_PINGPONG buffers;
+    if (!conv_scratch_pingpong(&buffers, buffer_width, tile_height + 2 * halo_y)) return 0;
+
+    int ok = 1;
+    for (int ty = start_row; ok && ty < end_row; ty += tile_height) {
+        int ty_end = ty + tile_height < end_row ? ty + tile_height : end_row;
+        int halo_start = ty - halo_y, halo_end = ty_end + halo_y;
+        if (!wrap && halo_start < 0) halo_start = 0;
+        if (!wrap && halo_end > src->height) halo_end = src->height;
+
+        // Rows [top, bottom) are the image the stages see, row top is surface row 0
+        int top = wrap ? halo_start : 0;
+        int bottom = wrap ? halo_end : src->height;
+
+        for (int tx = 0; ok && tx < src->width; tx += tile_width) {
+            int tx_end = tx + tile_width < src->width ? tx + tile_width : src->width;
+            int halo_left = tx - halo_x, halo_right = tx_end + halo_x;
+            if (!wrap && halo_left < 0) halo_left = 0;
+            if (!wrap && halo_right > src->width) halo_right = src->width;
+            int left = wrap ? halo_left : 0;
+            int right = wrap ? halo_right : src->width;
+
+            // Buffer column x, row y holds image column halo_left + x, row halo_start + y
+            if (wrap) {
+                image_to_planar_wrapped(src, pingpong_src(&buffers), halo_left, halo_start, halo_right, halo_end);
+            } else {
+                image_to_planar_tile(src, pingpong_src(&buffers), halo_left, halo_start, halo_right, halo_end);
+            }
+
+            // Stage k produces the tile grown by the radii of the stages after it
+            int rest_x = halo_x, rest_y = halo_y;
+            for (int k = 0; ok && k < num_kernels; k++) {
+                rest_x -= kernels[k].width / 2;
+                rest_y -= kernels[k].height / 2;
+                int y0 = ty - rest_y < top ? top : ty - rest_y;
+                int y1 = ty_end + rest_y > bottom ? bottom : ty_end + rest_y;
+                int x0 = tx - rest_x < left ? left : tx - rest_x;
+                int x1 = tx_end + rest_x > right ? right : tx_end + rest_x;
+
+                for (int c = 0; ok && c < PLANAR_CHANNELS; c++) {
+                    SURFACE in_plane = plane_surface(pingpong_src(&buffers), c, halo_right - halo_left,
+                                                     halo_start - top, bottom - top);
+                    SURFACE out_plane = plane_surface(pingpong_dst(&buffers), c, halo_right - halo_left,
+                                                      halo_start - top, bottom - top);
+                    ok = conv_surface_rows(&in_plane, &out_plane, &kernels[k], &stage_options, y0 - top, y1 - top,
+                                           x0 - halo_left, x1 - halo_left);
+                }
+                pingpong_swap(&buffers);
+            }
+
+            // The tile starts ty - halo_start rows and tx - halo_left columns into the last output
+            PLANAR tile = *pingpong_src(&buffers);
+            tile.data += (size_t)(ty - halo_start) * tile.stride + (tx - halo_left);
+            planar_to_image_tile(&tile, dst, tx, ty, tx_end, ty_end);
+        }
+    }
+
+    return ok;
+}
+
+// Convolve rows [start_row, end_row) of src into dst, a pipeline of one kernel, returns 1 on success
+int conv_rows(const IMAGE *src, IMAGE *dst, const KERNEL *kernel, const CONV_OPTIONS *options,
+              int start_row, int end_row) {
+    return conv_pipeline_rows(src, dst, kernel, 1, options, start_row, end_row);
+}
+
+// Rows [*start, *end) of band i when rows [start_row, end_row) are split into count bands
+static void band_range(int start_row, int end_row, int count, int i, int *start, int *end) {
+    int rows_per_band = (end_row - start_row) / count;
+    int remainder = (end_row - start_row) % count;
+
+    *start = start_row + i * rows_per_band + (i < remainder ? i : remainder);
+    *end = *start + rows_per_band + (i < remainder ? 1 : 0);
+}
+
+// Number of bands rows image rows are cut into for num_threads threads.
+// Each band is a row of cache tiles, and there are several bands per thread
+// so that threads that finish early steal bands from slower ones instead of
+// waiting for them.
+static int conv_band_count(int width, int rows, const KERNEL *kernels, int num_kernels,
+                           const CONV_OPTIONS *options, int num_threads) {
+    int tile_width, tile_height;
+    conv_tile_size(width, kernels, num_kernels, options, &tile_width, &tile_height);
+
+    int wanted = num_threads * CONV_BANDS_PER_THREAD;
+    int band_rows = (rows + wanted - 1) / wanted;
+    if (band_rows < CONV_MIN_TILE_ROWS) band_rows = CONV_MIN_TILE_ROWS;  // Keep the halo share small
+    if (band_rows > tile_height) band_rows = tile_height;
+
+    int count = (rows + band_rows - 1) / band_rows;
+    return count < num_threads ? num_threads : count;
+}
+
+// Threads to use for options, at most one per row
+static int conv_thread_count(int rows, const CONV_OPTIONS *options) {
+    int num_threads = options->num_threads;
+#ifdef CPU_COUNT
+    // Only the CPUs this process may run on, so a process bound to one
+    // socket, such as an MPI rank, keeps its threads on that socket
+    cpu_set_t cpus;
+    if (num_threads <= 0 && sched_getaffinity(0, sizeof(cpus), &cpus) == 0) num_threads = CPU_COUNT(&cpus);
+#endif
+    if (num_threads <= 0) num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads <= 0) num_threads = 1;
+    if (num_threads > rows) num_threads = rows;
+    return num_threads;
+}
+
+// Check that conv_pipeline can run on these arguments, returns 1 if so
+static int conv_check(const IMAGE *src, const IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                      const CONV_OPTIONS *options) {
+    if (num_kernels <= 0) {
+        printf("Error: Pipeline has no kernels.\n");
+        return 0;
+    }
+    if (src->width != dst->width || src->height != dst->height) {
+        printf("Error: Source and destination images differ in size.\n");
+        return 0;
+    }
+    if (src->data == dst->data) {
+        printf("Error: Convolution cannot run in place.\n");
+        return 0;
+    }
+    for (int k = 0; k < num_kernels; k++) {
+        if (options->precision == PRECISION_FIXED && !kernels[k].fixed) {
+            printf("Error: Kernel coefficients are too large for fixed point.\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Thread pool task for one row band
+static void conv_band_task(void *arg, int index) {
+    CONV_JOB *job = (CONV_JOB*)arg;
+    int start, end;
+
+    band_range(job->start_row, job->end_row, job->num_bands, index, &start, &end);
+    if (!conv_pipeline_rows(job->src, job->dst, job->kernels, job->num_kernels, job->options, start, end)) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Queue the bands of rows [start_row, end_row) on the thread pool, the arguments are checked
+static int conv_submit_range(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                             const CONV_OPTIONS *options, int start_row, int end_row, CONV_JOB *job) {
+    int num_threads = conv_thread_count(end_row - start_row, options);
+    THREAD_POOL *pool = options->pool ? options->pool : thread_pool_shared(num_threads);
+    if (!pool) return 0;
+
+    job->src = src;
+    job->dst = dst;
+    job->kernels = kernels;
+    job->num_kernels = num_kernels;
+    job->options = options;
+    job->start_row = start_row;
+    job->end_row = end_row;
+    job->num_bands = conv_band_count(src->width, end_row - start_row, kernels, num_kernels, options, num_threads);
+    job->failed = 0;
+    job->pool = pool;
+    thread_pool_submit(pool, &job->group, conv_band_task, job, job->num_bands);
+    return 1;
+}
+
+// Queue the row bands of rows [start_row, end_row) of a pipeline on the thread pool and return at once
+int conv_pipeline_range_submit(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                               const CONV_OPTIONS *options, int start_row, int end_row, CONV_JOB *job) {
+    job->pool = NULL;
+    job->failed = 0;
+    if (!conv_check(src, dst, kernels, num_kernels, options)) return 0;
+    if (options->backend != BACKEND_PTHREAD) {
+        return conv_pipeline_range(src, dst, kernels, num_kernels, options, start_row, end_row);
+    }
+    if (start_row < 0) start_row = 0;
+    if (end_row > src->height) end_row = src->height;
+    if (start_row >= end_row) return 1;
+    return conv_submit_range(src, dst, kernels, num_kernels, options, start_row, end_row, job);
+}
+
+// Queue the row bands of a pipeline on the thread pool and return at once
+int conv_pipeline_submit(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                         const CONV_OPTIONS *options, CONV_JOB *job) {
+    return conv_pipeline_range_submit(src, dst, kernels, num_kernels, options, 0, src->height, job);
+}
+
+// Queue the row bands of an image on the thread pool and return at once
+int conv_image_submit(const IMAGE *src, IMAGE *dst, const KERNEL *kernel, const CONV_OPTIONS *options,
+                      CONV_JOB *job) {
+    return conv_pipeline_submit(src, dst, kernel, 1, options, job);
+}
+
+// Wait for a job queued by conv_image_submit, helping with any queued bands
+// meanwhile, returns 1 when every band succeeded
+int conv_image_wait(CONV_JOB *job) {
+    if (job->pool) thread_pool_wait(job->pool, &job->group);
+    job->pool = NULL;
+    return !__atomic_load_n(&job->failed, __ATOMIC_ACQUIRE);
+}
+
+// Run a list of kernels over rows [start_row, end_row) with the selected backend, returns 1 on success
+int conv_pipeline_range(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                        const CONV_OPTIONS *options, int start_row, int end_row) {
+    if (!conv_check(src, dst, kernels, num_kernels, options)) return 0;
+    if (start_row < 0) start_row = 0;
+    if (end_row > src->height) end_row = src->height;
+    if (start_row >= end_row) return 1;
+
+    switch (options->backend) {
+    case BACKEND_PTHREAD: {
+        CONV_JOB job;
+        if (!conv_submit_range(src, dst, kernels, num_kernels, options, start_row, end_row, &job)) return 0;
+        return conv_image_wait(&job);
+    }
+
+    case BACKEND_OPENMP:
+#ifdef _OPENMP
+    {
+        // Same bands as the pool, handed out one at a time as threads free up
+        int num_threads = conv_thread_count(end_row - start_row, options);
+        int num_bands = conv_band_count(src->width, end_row - start_row, kernels, num_kernels, options,
+                                        num_threads);
+        int failed = 0;
+        #pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1) reduction(|:failed)
+        for (int i = 0; i < num_bands; i++) {
+            int start, end;
+            band_range(start_row, end_row, num_bands, i, &start, &end);
+            if (!conv_pipeline_rows(src, dst, kernels, num_kernels, options, start, end)) failed = 1;
+        }
+        return !failed;
+    }
+#else
+        printf("Warning: Built without OpenMP, running serially.\n");
+        return conv_pipeline_rows(src, dst, kernels, num_kernels, options, start_row, end_row);
+#endif
+
+    case BACKEND_SERIAL:
+    default:
+        return conv_pipeline_rows(src, dst, kernels, num_kernels, options, start_row, end_row);
+    }
+}
+
+// Run a list of kernels over a whole image with the selected backend, returns 1 on success
+int conv_pipeline(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                  const CONV_OPTIONS *options) {
+    return conv_pipeline_range(src, dst, kernels, num_kernels, options, 0, src->height);
+}
+
+// Convolve a whole image with the selected backend, returns 1 on success
+int conv_image(const IMAGE *src, IMAGE *dst, const KERNEL *kernel, const CONV_OPTIONS *options) {
+    return conv_pipeline(src, dst, kernel, 1, options);
+}
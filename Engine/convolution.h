@@ -0,0 +1,189 @@
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+#include "bmp.h"
+#include "border.h"
+#include "planar.h"
+#include "threadpool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Kernel descriptor: width x height coefficients, both odd
+typedef struct {
+    int width;              // Number of kernel columns
+    int height;             // Number of kernel rows
+    float *values;          // width * height coefficients, row-major
+    int separable;          // 1 when values == column x row (rank 1)
+    float *column;          // height factors of a separable kernel
+    float *row;             // width factors of a separable kernel
+    int16_t *fixed;         // values * 2^fixed_shift, NULL if they do not fit
+    int fixed_shift;        // Fractional bits of fixed
+    int32_t *fixed_column;  // column * 2^fixed_column_shift
+    int32_t *fixed_row;     // row * 2^fixed_row_shift
+    int fixed_column_shift;
+    int fixed_row_shift;
+    int *fixed_order;       // Non-zero taps of fixed by weight, see kernel_group_taps
+    int *fixed_bounds;      // Group g of equal weights is fixed_order[fixed_bounds[g], fixed_bounds[g + 1])
+    int32_t *fixed_pairs;   // Weights of groups 2i and 2i + 1 as two 16-bit halves
+    int fixed_groups;       // Number of groups, always even
+    int taps;               // Coefficients that are not zero
+    int exact;              // 1 when float sums equal the integer sums of fixed, see kernel_classify
+} KERNEL;
+
+// Backend used to run a convolution over a whole image
+typedef enum {
+    BACKEND_SERIAL,         // Single thread
+    BACKEND_PTHREAD,        // Row bands on a persistent work-stealing thread pool
+    BACKEND_OPENMP          // OpenMP loop over row bands, dynamic schedule
+} BACKEND;
+
+// Instruction set used by the direct convolution loop
+typedef enum {
+    SIMD_SCALAR,            // Portable loop
+    SIMD_AVX2,              // AVX2 + FMA, 32 samples per iteration
+    SIMD_AVX512             // AVX-512F, 64 samples per iteration
+} SIMD_LEVEL;
+
+// Arithmetic used to accumulate the kernel taps
+typedef enum {
+    PRECISION_FLOAT,        // float sums, truncated to bytes
+    PRECISION_FIXED         // integer sums of fixed-point coefficients, rounded half up
+} PRECISION;
+
+// How the taps of a kernel are summed
+typedef enum {
+    METHOD_AUTO,            // FFT where its estimated cost is lower, e.g. large non-separable kernels
+    METHOD_DIRECT,          // Every tap of every pixel
+    METHOD_FFT              // Overlap-save FFT blocks, PRECISION_FLOAT only
+} CONV_METHOD;
+
+// Options for conv_image
+typedef struct {
+    BACKEND backend;
+    int num_threads;        // 0 = one per CPU the process may run on
+    PRECISION precision;
+    BORDER_MODE border;
+    CONV_METHOD method;     // PRECISION_FIXED always sums directly
+    int tile_width;         // Columns per cache tile, 0 = sized from the L2 cache
+    int tile_height;        // Rows per cache tile, 0 = sized from the L2 cache
+    THREAD_POOL *pool;      // Workers for BACKEND_PTHREAD, NULL = thread_pool_shared
+} CONV_OPTIONS;
+
+// One image queued on the thread pool by conv_image_submit, conv_pipeline_submit
+// or conv_pipeline_range_submit
+typedef struct {
+    const IMAGE *src;
+    IMAGE *dst;
+    const KERNEL *kernels;
+    int num_kernels;
+    const CONV_OPTIONS *options;
+    int start_row;          // Rows [start_row, end_row) are convolved
+    int end_row;
+    int num_bands;          // Row bands the rows are split into
+    int failed;             // Set by any band that ran out of memory, read by conv_image_wait
+    THREAD_POOL *pool;      // NULL once the job has finished
+    TASK_GROUP group;
+} CONV_JOB;
+
+// Fill options with the defaults (serial backend, float precision, zero
+// border, automatic method and tiles)
+void conv_default_options(CONV_OPTIONS *options);
+
+// Highest level supported by this CPU, or the level set by conv_set_simd_level
+SIMD_LEVEL conv_simd_level(void);
+
+// Limit the direct convolution loop to the given level. Every level gives
+// bit-identical output, so this only changes speed.
+void conv_set_simd_level(SIMD_LEVEL level);
+
+// Copy width * height coefficients into a kernel, detect whether it is
+// separable and quantize it for PRECISION_FIXED, returns 1 on success.
+// Fixed point keeps as many fractional bits as the 16-bit coefficients and
+// 32-bit sums allow, so results are byte-identical on every backend.
+// Kernels of integers or short binary fractions, such as sharpen and edge
+// detection, also run PRECISION_FLOAT on integer sums, with the same bytes.
+int kernel_init(KERNEL *kernel, int width, int height, const float *values);
+
+// kernel_init with a kernel of any odd size read by kernel_read, from a file
+// or from spec itself, returns 1 on success
+int kernel_load(KERNEL *kernel, const char *spec);
+
+// Free the coefficients of a kernel
+void kernel_free(KERNEL *kernel);
+
+// Convolve columns [x_begin, x_end) of one output row.
+// rows[ky] points to the input row under kernel row ky, or is NULL when that
+// row reads as zero. Rows outside the image must already point at the row
+// options->border maps them to, and under BORDER_AVERAGE a NULL row counts as
+// outside the image. Samples of a pixel are channels bytes apart and pixels
+// outside [0, width) follow options->border. options may be NULL for defaults.
+void conv_row(const unsigned char *const *rows, unsigned char *out, int width, int channels,
+              int x_begin, int x_end, const KERNEL *kernel, const CONV_OPTIONS *options);
+
+// Convolve rows [start_row, end_row) of every plane of src into dst, pixels
+// outside the image follow options->border. Separable kernels run as a
+// horizontal pass followed by a vertical pass. Returns 0 if memory runs out.
+int conv_planar_rows(const PLANAR *src, PLANAR *dst, const KERNEL *kernel, const CONV_OPTIONS *options,
+                     int start_row, int end_row);
+
+// Convolve rows [start_row, end_row) of src into dst, pixels outside the
+// image follow options->border. The rows are processed in tiles sized to the
+// L2 cache: each tile and its halo are split into planes, convolved and
+// merged back. Returns 0 if memory runs out.
+int conv_rows(const IMAGE *src, IMAGE *dst, const KERNEL *kernel, const CONV_OPTIONS *options,
+              int start_row, int end_row);
+
+// Run kernels[0], ..., kernels[num_kernels - 1] in turn over rows
+// [start_row, end_row) and write the result of the last one into dst. Each
+// stage sees the previous result with options->border, exactly as if every
+// kernel ran over the whole image, but the stages are fused per cache tile so
+// no intermediate image is written to memory. Returns 0 if memory runs out,
+// and the rows of dst are then only partly written.
+int conv_pipeline_rows(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                       const CONV_OPTIONS *options, int start_row, int end_row);
+
+// Run a pipeline of kernels over a whole image with the selected backend,
+// returns 1 on success and 0 when the arguments are rejected or memory runs
+// out. src and dst must have the same size and must not share pixel data.
+int conv_pipeline(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                  const CONV_OPTIONS *options);
+
+// conv_pipeline for rows [start_row, end_row) of dst only. The rows around
+// them are read as usual, so a window of rows holding the halo of the whole
+// pipeline gives the same rows as the full image. Returns 1 on success.
+int conv_pipeline_range(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                        const CONV_OPTIONS *options, int start_row, int end_row);
+
+// Convolve a whole image with the selected backend, returns 1 on success.
+// src and dst must have the same size and must not share pixel data.
+int conv_image(const IMAGE *src, IMAGE *dst, const KERNEL *kernel, const CONV_OPTIONS *options);
+
+// Start conv_image without waiting for it, returns 1 on success. With
+// BACKEND_PTHREAD the row bands are queued on the pool, so bands of several
+// images in flight are shared out and stolen together; other backends run
+// to completion here. The images, kernel, options and job must stay valid
+// until conv_image_wait returns, which reports whether the bands succeeded.
+int conv_image_submit(const IMAGE *src, IMAGE *dst, const KERNEL *kernel, const CONV_OPTIONS *options,
+                      CONV_JOB *job);
+
+// conv_image_submit for a pipeline of kernels
+int conv_pipeline_submit(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                         const CONV_OPTIONS *options, CONV_JOB *job);
+
+// conv_pipeline_submit for rows [start_row, end_row) of dst only, see
+// conv_pipeline_range
+int conv_pipeline_range_submit(const IMAGE *src, IMAGE *dst, const KERNEL *kernels, int num_kernels,
+                               const CONV_OPTIONS *options, int start_row, int end_row, CONV_JOB *job);
+
+// Wait for a job started by conv_image_submit, conv_pipeline_submit or
+// conv_pipeline_range_submit, returns 1 when every band succeeded and 0 when
+// any ran out of memory, leaving dst partly written
+int conv_image_wait(CONV_JOB *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
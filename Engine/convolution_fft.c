@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "convolution_fft.h"
+#include "fft.h"
+
+// Largest side of an FFT block
+#define CONV_FFT_MAX_SIZE 1024
+
+// Cost model in nanoseconds per operation, measured with AVX2 on one core:
+// one tap of one sample in the direct loops (SIMD, scalar and the scalar
+// separable passes), one FFT butterfly, and the work on each point of a block
+// around its transforms (gather, product with the kernel, conversion)
+#define CONV_TAP_COST 0.12
+#define CONV_SCALAR_TAP_COST 0.6
+#define CONV_SEPARABLE_TAP_COST 1.8
+#define CONV_BUTTERFLY_COST 3.0
+#define CONV_POINT_COST 6.0
+
+// Cost of transforming one block of ny x nx points forwards and back
+static double conv_fft_block_cost(int ny, int nx) {
+    double points = (double)ny * nx;
+    return 2.0 * (points / 2 * log2(points) * CONV_BUTTERFLY_COST + points * CONV_POINT_COST);
+}
+
+// Cheapest block size for num_rows x columns outputs, returns its cost or
+// HUGE_VAL when the kernel does not fit in CONV_FFT_MAX_SIZE
+static double conv_fft_block_size(const KERNEL *kernel, int num_rows, int columns, int *ny, int *nx) {
+    double best = HUGE_VAL;
+    int max_y = fft_size(num_rows + kernel->height - 1);
+    int max_x = fft_size(columns + kernel->width - 1);
+    if (max_y > CONV_FFT_MAX_SIZE) max_y = CONV_FFT_MAX_SIZE;
+    if (max_x > CONV_FFT_MAX_SIZE) max_x = CONV_FFT_MAX_SIZE;
+
+    for (int y = fft_size(kernel->height); y <= max_y; y <<= 1) {
+        for (int x = fft_size(kernel->width); x <= max_x; x <<= 1) {
+            // Every block gives n - k + 1 outputs along each axis, two blocks share a transform
+            double blocks = (double)((num_rows + y - kernel->height) / (y - kernel->height + 1)) *
+                            ((columns + x - kernel->width) / (x - kernel->width + 1));
+            double cost = (blocks / 2 + 1) * conv_fft_block_cost(y, x);
+            if (cost < best) {
+                best = cost;
+                *ny = y;
+                *nx = x;
+            }
+        }
+    }
+    return best;
+}
+
+// Estimated cost of both methods, 1 when the FFT is cheaper
+int conv_fft_faster(const KERNEL *kernel, int num_rows, int columns) {
+    double samples = (double)num_rows * columns;
+    double direct;
+    if (kernel->separable) {
+        direct = samples * (kernel->width + kernel->height) * CONV_SEPARABLE_TAP_COST;
+    } else {
+        direct = samples * kernel->taps * (conv_simd_level() == SIMD_SCALAR ? CONV_SCALAR_TAP_COST : CONV_TAP_COST);
+    }
+
+    int ny, nx;
+    return conv_fft_block_size(kernel, num_rows, columns, &ny, &nx) < direct;
+}
+
+// Layout of the blocks of one conv_fft_rows call
+typedef struct {
+    const unsigned char *const *rows;
+    unsigned char *const *out;
+    int num_rows;
+    int width;
+    int channels;
+    int x_begin;
+    int x_end;
+    int ny, nx;                 // FFT size
+    int block_h, block_w;       // Outputs per block
+    int blocks_x;
+} CONV_FFT_BLOCKS;
+
+// Split block b into its channel and the first output row and column
+static void conv_fft_block(const CONV_FFT_BLOCKS *blocks, int b, int *c, int *row, int *column) {
+    *c = b % blocks->channels;
+    b /= blocks->channels;
+    *row = (b / blocks->blocks_x) * blocks->block_h;
+    *column = blocks->x_begin + (b % blocks->blocks_x) * blocks->block_w;
+}
+
+// Copy the input of block b into the real (part 0) or imaginary (part 1) parts of data
+static void conv_fft_gather(const CONV_FFT_BLOCKS *blocks, const KERNEL *kernel, BORDER_MODE border, int b,
+                            FFT_COMPLEX *data, int part) {
+    int c, row, column;
+    conv_fft_block(blocks, b, &c, &row, &column);
+    int channels = blocks->channels;
+    int last_row = blocks->num_rows + kernel->height - 1;   // Input rows the call has
+    int last_column = blocks->x_end + kernel->width / 2;   // Input columns it reads
+    int x0 = column - kernel->width / 2;
+
+    for (int i = 0; i < blocks->ny; i++) {
+        FFT_COMPLEX *line = data + (size_t)i * blocks->nx;
+        const unsigned char *in = row + i < last_row ? blocks->rows[row + i] : NULL;
+
+        for (int j = 0; j < blocks->nx; j++) {
+            int x = x0 + j;
+            double value = 0.0;
+            if (in && x < last_column) {
+                if (x < 0 || x >= blocks->width) x = border_index(x, blocks->width, border);
+                if (x >= 0) value = in[x * channels + c];
+            }
+
+            if (part) {
+                line[j].im = value;
+            } else {
+                line[j].re = value;
+            }
+        }
+    }
+}
+
+// Write the outputs of block b from the real (part 0) or imaginary (part 1)
+// parts of data. corners holds the running sums of the kernel for BORDER_AVERAGE.
+static void conv_fft_scatter(const CONV_FFT_BLOCKS *blocks, const KERNEL *kernel, BORDER_MODE border, int b,
+                             const FFT_COMPLEX *data, int part, const double *corners) {
+    int c, row, column;
+    conv_fft_block(blocks, b, &c, &row, &column);
+    int channels = blocks->channels;
+    int kw = kernel->width, kh = kernel->height;
+    int radius_x = kw / 2;
+    double norm = 1.0 / ((double)blocks->ny * blocks->nx);
+
+    for (int t = 0; t < blocks->block_h && row + t < blocks->num_rows; t++) {
+        int y = row + t;
+        const FFT_COMPLEX *line = data + (size_t)t * blocks->nx;
+
+        // Kernel rows [ky0, ky1) read rows inside the image
+        int ky0 = 0, ky1 = kh;
+        if (border == BORDER_AVERAGE) {
+            while (ky0 < kh && !blocks->rows[y + ky0]) ky0++;
+            while (ky1 > ky0 && !blocks->rows[y + ky1 - 1]) ky1--;
+        }
+
+        for (int u = 0; u < blocks->block_w && column + u < blocks->x_end; u++) {
+            int x = column + u;
+            double value = (part ? line[u].im : line[u].re) * norm;
+
+            // Exact kernels sum to a multiple of 2^-fixed_shift, round away the FFT error
+            if (kernel->exact) value = ldexp(nearbyint(ldexp(value, kernel->fixed_shift)), -kernel->fixed_shift);
+
+            if (border == BORDER_AVERAGE) {
+                int kx0 = radius_x - x > 0 ? radius_x - x : 0;
+                int kx1 = blocks->width + radius_x - x < kw ? blocks->width + radius_x - x : kw;
+                if (ky0 > 0 || ky1 < kh || kx0 > 0 || kx1 < kw) {
+                    double inside = corners[ky1 * (kw + 1) + kx1] - corners[ky0 * (kw + 1) + kx1] -
+                                    corners[ky1 * (kw + 1) + kx0] + corners[ky0 * (kw + 1) + kx0];
+                    // Scaled in float like the direct loops, exact sums then give the same bytes
+                    value = (float)value * border_average_scale((float)corners[kh * (kw + 1) + kw], (float)inside);
+                }
+            }
+
+            value = value < 0 ? 0 : (value > 255 ? 255 : value);
+            blocks->out[y][x * channels + c] = (unsigned char)value;
+        }
+    }
+}
+
+// Convolve num_rows output rows with FFT blocks, returns 0 if memory runs out
+int conv_fft_rows(const unsigned char *const *rows, unsigned char *const *out, int num_rows, int width,
+                  int channels, int x_begin, int x_end, const KERNEL *kernel, BORDER_MODE border) {
+    int kw = kernel->width, kh = kernel->height;
+    if (num_rows <= 0 || x_end <= x_begin) return 1;
+
+    CONV_FFT_BLOCKS blocks;
+    blocks.rows = rows;
+    blocks.out = out;
+    blocks.num_rows = num_rows;
+    blocks.width = width;
+    blocks.channels = channels;
+    blocks.x_begin = x_begin;
+    blocks.x_end = x_end;
+    if (conv_fft_block_size(kernel, num_rows, x_end - x_begin, &blocks.ny, &blocks.nx) == HUGE_VAL) return 0;
+    blocks.block_h = blocks.ny - kh + 1;
+    blocks.block_w = blocks.nx - kw + 1;
+    blocks.blocks_x = (x_end - x_begin + blocks.block_w - 1) / blocks.block_w;
+    int count = ((num_rows + blocks.block_h - 1) / blocks.block_h) * blocks.blocks_x * channels;
+
+    size_t points = (size_t)blocks.ny * blocks.nx;
+    FFT_PLAN plan_x, plan_y;
+    int plans = fft_plan_init(&plan_x, blocks.nx);
+    plans = fft_plan_init(&plan_y, blocks.ny) && plans;
+    FFT_COMPLEX *spectrum = (FFT_COMPLEX*)calloc(points, sizeof(FFT_COMPLEX));
+    FFT_COMPLEX *data = (FFT_COMPLEX*)malloc(sizeof(FFT_COMPLEX) * points);
+    FFT_COMPLEX *scratch = (FFT_COMPLEX*)malloc(sizeof(FFT_COMPLEX) * points);
+    double *corners = (double*)calloc((size_t)(kh + 1) * (kw + 1), sizeof(double));
+    if (!plans || !spectrum || !data || !scratch || !corners) {
+        fft_plan_free(&plan_x);
+        fft_plan_free(&plan_y);
+        free(spectrum);
+        free(data);
+        free(scratch);
+        free(corners);
+        return 0;
+    }
+
+    // Output t reads input t + k, so tap (ky, kx) goes to (-ky, -kx) of the circular kernel
+    for (int ky = 0; ky < kh; ky++) {
+        for (int kx = 0; kx < kw; kx++) {
+            size_t i = (size_t)((blocks.ny - ky) % blocks.ny) * blocks.nx + (blocks.nx - kx) % blocks.nx;
+            spectrum[i].re = kernel->values[ky * kw + kx];
+        }
+    }
+    fft_2d(&plan_x, &plan_y, spectrum, scratch, 0);
+
+    // corners[ky * (kw + 1) + kx] is the sum of taps above and left of (ky, kx)
+    for (int ky = 0; ky < kh; ky++) {
+        for (int kx = 0; kx < kw; kx++) {
+            corners[(ky + 1) * (kw + 1) + kx + 1] = kernel->values[ky * kw + kx] + corners[ky * (kw + 1) + kx + 1] +
+                                                    corners[(ky + 1) * (kw + 1) + kx] - corners[ky * (kw + 1) + kx];
+        }
+    }
+
+    // The kernel is real, so two blocks go through each transform, one as the
+    // real part and one as the imaginary part, and come out the same way
+    for (int b = 0; b < count; b += 2) {
+        conv_fft_gather(&blocks, kernel, border, b, data, 0);
+        if (b + 1 < count) {
+            conv_fft_gather(&blocks, kernel, border, b + 1, data, 1);
+        } else {
+            for (size_t i = 0; i < points; i++) data[i].im = 0.0;
+        }
+
+        fft_2d(&plan_x, &plan_y, data, scratch, 0);
+        for (size_t i = 0; i < points; i++) {
+            double re = data[i].re * spectrum[i].re - data[i].im * spectrum[i].im;
+            data[i].im = data[i].re * spectrum[i].im + data[i].im * spectrum[i].re;
+            data[i].re = re;
+        }
+        fft_2d(&plan_x, &plan_y, data, scratch, 1);
+
+        conv_fft_scatter(&blocks, kernel, border, b, data, 0, corners);
+        if (b + 1 < count) conv_fft_scatter(&blocks, kernel, border, b + 1, data, 1, corners);
+    }
+
+    fft_plan_free(&plan_x);
+    fft_plan_free(&plan_y);
+    free(spectrum);
+    free(data);
+    free(scratch);
+    free(corners);
+    return 1;
+}
@@ -0,0 +1,22 @@
+#ifndef CONVOLUTION_FFT_H
+#define CONVOLUTION_FFT_H
+
+#include "convolution.h"
+
+// Estimated cost of convolving num_rows x columns samples directly and with
+// FFT blocks, returns 1 when the FFT is cheaper. Small kernels never are,
+// separable ones only when they are very large.
+int conv_fft_faster(const KERNEL *kernel, int num_rows, int columns);
+
+// Convolve num_rows output rows with FFT blocks (overlap-save). Output row i
+// reads input rows rows[i], ..., rows[i + kernel->height - 1], NULL rows read
+// as zero and count as outside the image under BORDER_AVERAGE. Columns
+// [x_begin, x_end) of each out[i] are written, pixels outside [0, width)
+// follow border. Results are float sums truncated like the direct loops:
+// identical for exact kernels (see kernel_classify), otherwise they can
+// differ by one where a sum lies within rounding error of an integer.
+// Returns 0 if memory runs out, nothing has been written then.
+int conv_fft_rows(const unsigned char *const *rows, unsigned char *const *out, int num_rows, int width,
+                  int channels, int x_begin, int x_end, const KERNEL *kernel, BORDER_MODE border);
+
+#endif
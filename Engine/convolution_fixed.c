@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "convolution_fixed.h"
+
+// Largest shift s <= 30 such that every |v| * 2^s rounds to at most
+// max_coefficient and input_max * sum(|q|) + 2^s stays within max_sum.
+// Returns -1 when not even s = 0 fits.
+static int fixed_shift_for(const float *values, int count, int64_t max_coefficient,
+                           int64_t input_max, int64_t max_sum) {
+    for (int shift = 30; shift >= 0; shift--) {
+        double scale = ldexp(1.0, shift);
+        int64_t sum = 0;
+        int fits = 1;
+
+        for (int i = 0; i < count; i++) {
+            int64_t q = llround(fabs((double)values[i]) * scale);
+            if (q > max_coefficient) {
+                fits = 0;
+                break;
+            }
+            sum += q;
+        }
+
+        if (fits && sum <= (max_sum - ((int64_t)1 << shift)) / input_max) return shift;
+    }
+    return -1;
+}
+
+// Quantize the coefficients and separable factors of a kernel to fixed point
+void kernel_quantize(KERNEL *kernel) {
+    int count = kernel->width * kernel->height;
+
+    kernel->fixed = NULL;
+    kernel->fixed_row = NULL;
+    kernel->fixed_column = NULL;
+
+    // 2D coefficients are 16-bit for the SIMD multiply-add, sums are 32-bit
+    kernel->fixed_shift = fixed_shift_for(kernel->values, count, INT16_MAX, 255, INT32_MAX);
+    if (kernel->fixed_shift >= 0) {
+        kernel->fixed = (int16_t*)malloc(sizeof(int16_t) * count);
+        if (kernel->fixed) {
+            double scale = ldexp(1.0, kernel->fixed_shift);
+            for (int i = 0; i < count; i++) kernel->fixed[i] = (int16_t)llround(kernel->values[i] * scale);
+        }
+    }
+
+    if (!kernel->separable) return;
+
+    // Horizontal sums keep all fractional bits in 32 bits, the vertical pass sums in 64 bits
+    kernel->fixed_row_shift = fixed_shift_for(kernel->row, kernel->width, INT16_MAX, 255, (int64_t)1 << 30);
+    kernel->fixed_column_shift = fixed_shift_for(kernel->column, kernel->height, INT16_MAX,
+                                                 (int64_t)1 << 30, (int64_t)1 << 62);
+    if (kernel->fixed_row_shift < 0 || kernel->fixed_column_shift < 0) return;
+
+    kernel->fixed_row = (int32_t*)malloc(sizeof(int32_t) * kernel->width);
+    kernel->fixed_column = (int32_t*)malloc(sizeof(int32_t) * kernel->height);
+    if (!kernel->fixed_row || !kernel->fixed_column) {
+        free(kernel->fixed_row);
+        free(kernel->fixed_column);
+        kernel->fixed_row = NULL;
+        kernel->fixed_column = NULL;
+        return;
+    }
+
+    double row_scale = ldexp(1.0, kernel->fixed_row_shift);
+    double column_scale = ldexp(1.0, kernel->fixed_column_shift);
+    for (int x = 0; x < kernel->width; x++) kernel->fixed_row[x] = (int32_t)llround(kernel->row[x] * row_scale);
+    for (int y = 0; y < kernel->height; y++) kernel->fixed_column[y] = (int32_t)llround(kernel->column[y] * column_scale);
+}
+
+// Count the non-zero taps and decide whether the float sums of a kernel are exact
+void kernel_classify(KERNEL *kernel) {
+    int count = kernel->width * kernel->height;
+
+    kernel->taps = 0;
+    for (int i = 0; i < count; i++) {
+        if (kernel->values[i] != 0.0f) kernel->taps++;
+    }
+
+    kernel->exact = 0;
+    if (!kernel->fixed) return;
+
+    // Fractional bits the coefficients need, and the largest partial sum
+    double scale = ldexp(1.0, kernel->fixed_shift);
+    double magnitude = 0.0;
+    int bits = 0;
+    for (int i = 0; i < count; i++) {
+        double value = kernel->values[i];
+        if ((double)kernel->fixed[i] != value * scale) return;  // Rounded by quantizing
+
+        while (ldexp(value, bits) != floor(ldexp(value, bits))) bits++;
+        magnitude += fabs(value);
+    }
+
+    // Multiples of 2^-bits below 2^(24 - bits) fit the 24-bit float significand
+    kernel->exact = 255.0 * magnitude * ldexp(1.0, bits) <= 16777216.0;
+}
+
+// Group the non-zero taps of a quantized kernel by weight, once per kernel
+void kernel_group_taps(KERNEL *kernel) {
+    kernel->fixed_order = NULL;
+    kernel->fixed_bounds = NULL;
+    kernel->fixed_pairs = NULL;
+    kernel->fixed_groups = 0;
+    if (!kernel->fixed) return;
+
+    int count = kernel->width * kernel->height;
+    int *order = (int*)malloc(sizeof(int) * (count + 1));
+    int *bounds = (int*)malloc(sizeof(int) * (count + 2));
+    int32_t *pairs = (int32_t*)malloc(sizeof(int32_t) * (count / 2 + 1));
+    if (!order || !bounds || !pairs) {
+        free(order);
+        free(bounds);
+        free(pairs);
+        return;
+    }
+
+    // Insertion sort by weight, equal weights keep their order in the kernel
+    int taps = 0;
+    for (int i = 0; i < count; i++) {
+        int16_t weight = kernel->fixed[i];
+        if (!weight) continue;
+
+        int t = taps++;
+        for (; t > 0 && kernel->fixed[order[t - 1]] > weight; t--) order[t] = order[t - 1];
+        order[t] = i;
+    }
+
+    int groups = 0;
+    bounds[0] = 0;
+    for (int t = 1; t <= taps; t++) {
+        if (t == taps || kernel->fixed[order[t]] != kernel->fixed[order[t - 1]] ||
+            t - bounds[groups] == FIXED_MAX_GROUP) {
+            bounds[++groups] = t;
+        }
+    }
+    for (int g = 0; g < groups; g += 2) {
+        int16_t a = kernel->fixed[order[bounds[g]]];
+        int16_t b = g + 1 < groups ? kernel->fixed[order[bounds[g + 1]]] : 0;
+        pairs[g / 2] = (int32_t)((uint16_t)a | ((uint32_t)(uint16_t)b << 16));
+    }
+    if (groups & 1) {
+        order[taps] = order[taps - 1];
+        bounds[++groups] = ++taps;
+    }
+
+    kernel->fixed_order = order;
+    kernel->fixed_bounds = bounds;
+    kernel->fixed_pairs = pairs;
+    kernel->fixed_groups = groups;
+}
+
+// Fixed-point version of one pixel near the edge of the image
+void conv_pixel_border_fixed(const unsigned char *const *rows, unsigned char *out, int width, int channels,
+                             int x, const KERNEL *kernel, BORDER_MODE border) {
+    int radius_x = kernel->width / 2;
+
+    // BORDER_AVERAGE reweights the taps inside the image to the whole kernel
+    int64_t total = 0, inside = 0;
+    if (border == BORDER_AVERAGE) {
+        for (int i = 0; i < kernel->width * kernel->height; i++) {
+            int ix = x + i % kernel->width - radius_x;
+            total += kernel->fixed[i];
+            if (rows[i / kernel->width] && ix >= 0 && ix < width) inside += kernel->fixed[i];
+        }
+    }
+
+    for (int color = 0; color < channels; color++) {
+        int32_t sum = 0;
+
+        for (int ky = 0; ky < kernel->height; ky++) {
+            const unsigned char *row = rows[ky];
+            if (!row) continue;  // Zero padding above and below the image
+
+            const int16_t *k = kernel->fixed + ky * kernel->width;
+            for (int kx = 0; kx < kernel->width; kx++) {
+                int ix = border_index(x + kx - radius_x, width, border);
+                if (ix < 0) continue;  // Zero padding left and right
+
+                sum += row[ix * channels + color] * k[kx];
+            }
+        }
+
+        out[x * channels + color] = fixed_to_byte(fixed_average(sum, total, inside) +
+                                                  FIXED_HALF(kernel->fixed_shift), kernel->fixed_shift);
+    }
+}
+
+// Fixed-point horizontal pass for one pixel near the left or right edge
+static void conv_pixel_horizontal_fixed(const unsigned char *row, int32_t *out, int width, int channels,
+                                        int x, const KERNEL *kernel, BORDER_MODE border) {
+    int radius_x = kernel->width / 2;
+
+    int64_t total = 0, inside = 0;
+    if (border == BORDER_AVERAGE) {
+        for (int kx = 0; kx < kernel->width; kx++) {
+            int ix = x + kx - radius_x;
+            total += kernel->fixed_row[kx];
+            if (ix >= 0 && ix < width) inside += kernel->fixed_row[kx];
+        }
+    }
+
+    for (int color = 0; color < channels; color++) {
+        int32_t sum = 0;
+        for (int kx = 0; kx < kernel->width; kx++) {
+            int ix = border_index(x + kx - radius_x, width, border);
+            if (ix < 0) continue;  // Zero padding left and right
+
+            sum += row[ix * channels + color] * kernel->fixed_row[kx];
+        }
+
+        // Reweighting can leave the range of the ring, the result is clamped later anyway
+        int64_t scaled = fixed_average(sum, total, inside);
+        out[x * channels + color] = (int32_t)(scaled < INT32_MIN ? INT32_MIN : (scaled > INT32_MAX ? INT32_MAX : scaled));
+    }
+}
+
+// Fixed-point horizontal pass of a separable kernel over columns [x_begin, x_end),
+// keeps all fractional bits
+void conv_row_horizontal_fixed(const unsigned char *row, int32_t *out, int width, int channels,
+                               int x_begin, int x_end, const KERNEL *kernel, BORDER_MODE border) {
+    int radius_x = kernel->width / 2;
+    int inner_begin = radius_x > x_begin ? radius_x : x_begin;
+    int inner_end = width - radius_x < x_end ? width - radius_x : x_end;
+    if (inner_begin > x_end) inner_begin = x_end;
+    if (inner_end < inner_begin) inner_end = inner_begin;
+
+    for (int x = x_begin; x < inner_begin; x++) {
+        conv_pixel_horizontal_fixed(row, out, width, channels, x, kernel, border);
+    }
+
+    // Interior pixels have every tap inside the row
+    for (int s = inner_begin * channels; s < inner_end * channels; s++) {
+        const unsigned char *in = row + s - radius_x * channels;
+        int32_t sum = 0;
+        for (int kx = 0; kx < kernel->width; kx++) {
+            sum += in[kx * channels] * kernel->fixed_row[kx];
+        }
+        out[s] = sum;
+    }
+
+    for (int x = inner_end; x < x_end; x++) {
+        conv_pixel_horizontal_fixed(row, out, width, channels, x, kernel, border);
+    }
+}
+
+// Fixed-point vertical pass of a separable kernel over samples [s_begin, s_end),
+// rows[ky] is NULL for zero rows
+void conv_row_vertical_fixed(const int32_t *const *rows, unsigned char *out, int s_begin, int s_end,
+                             const KERNEL *kernel, BORDER_MODE border) {
+    int shift = kernel->fixed_row_shift + kernel->fixed_column_shift;
+
+    int64_t total = 0, inside = 0;
+    if (border == BORDER_AVERAGE) {
+        for (int ky = 0; ky < kernel->height; ky++) {
+            total += kernel->fixed_column[ky];
+            if (rows[ky]) inside += kernel->fixed_column[ky];
+        }
+    }
+
+    if (inside != total) {
+        for (int s = s_begin; s < s_end; s++) {
+            int64_t sum = 0;
+            for (int ky = 0; ky < kernel->height; ky++) {
+                if (rows[ky]) sum += (int64_t)rows[ky][s] * kernel->fixed_column[ky];
+            }
+            out[s] = fixed_to_byte(fixed_average(sum, total, inside) + FIXED_HALF(shift), shift);
+        }
+        return;
+    }
+
+    for (int s = s_begin; s < s_end; s++) {
+        int64_t sum = FIXED_HALF(shift);
+        for (int ky = 0; ky < kernel->height; ky++) {
+            if (rows[ky]) sum += (int64_t)rows[ky][s] * kernel->fixed_column[ky];
+        }
+        out[s] = fixed_to_byte(sum, shift);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef CONVOLUTION_FIXED_H
+#define CONVOLUTION_FIXED_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include "convolution.h"
+
+// Rounding term added to a sum with shift fractional bits
+#define FIXED_HALF(shift) ((shift) > 0 ? (int64_t)1 << ((shift) - 1) : 0)
+
+// Drop the fractional bits of a sum that already holds FIXED_HALF and clamp
+// it to [0, 255]. The shift is arithmetic, so results round half up.
+static inline unsigned char fixed_to_byte(int64_t acc, int shift) {
+    int64_t value = acc >> shift;
+    return (unsigned char)(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+// Scale a fixed-point sum, without its rounding term, by total / inside for
+// BORDER_AVERAGE, see border_average_scale. Rounds towards minus infinity so
+// the rounding term added afterwards still rounds half up.
+static inline int64_t fixed_average(int64_t sum, int64_t total, int64_t inside) {
+    if (inside == 0 || inside == total) return sum;
+    return (int64_t)floor((double)sum * (double)total / (double)inside);
+}
+
+// Quantize the coefficients and separable factors of a kernel to fixed point
+void kernel_quantize(KERNEL *kernel);
+
+// Count the non-zero taps of a quantized kernel and decide whether it is
+// exact: fixed holds every coefficient without rounding and every partial
+// float sum of bytes times coefficients is exact. The float result is then
+// the integer sum of fixed truncated, which the integer loops compute.
+void kernel_classify(KERNEL *kernel);
+
+// Taps summed as 16-bit words before their one multiply, at most as many
+// as keep 255 * count within a signed word
+#define FIXED_MAX_GROUP 128
+
+// Order the non-zero taps of fixed by weight and split them into groups of
+// equal weights, at most FIXED_MAX_GROUP each, for the integer SIMD loops.
+// An odd last group is paired with a repeat of the last tap under a zero
+// weight. The fields stay NULL when fixed is NULL or memory runs out.
+void kernel_group_taps(KERNEL *kernel);
+
+// Fixed-point version of one pixel near the edge of the image
+void conv_pixel_border_fixed(const unsigned char *const *rows, unsigned char *out, int width, int channels,
+                             int x, const KERNEL *kernel, BORDER_MODE border);
+
+// Fixed-point horizontal pass of a separable kernel over columns [x_begin, x_end),
+// keeps all fractional bits
+void conv_row_horizontal_fixed(const unsigned char *row, int32_t *out, int width, int channels,
+                               int x_begin, int x_end, const KERNEL *kernel, BORDER_MODE border);
+
+// Fixed-point vertical pass of a separable kernel over samples [s_begin, s_end),
+// rows[ky] is NULL for zero rows
+void conv_row_vertical_fixed(const int32_t *const *rows, unsigned char *out, int s_begin, int s_end,
+                             const KERNEL *kernel, BORDER_MODE border);
+
+#endif
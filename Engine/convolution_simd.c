@@ -0,0 +1,449 @@
+#include <math.h>
+
+#include <stdlib.h>
+
+#include "convolution_simd.h"
+#include "convolution_fixed.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONV_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// -1 until the CPU has been checked
+static int simd_level = -1;
+
+// Clamp to [0, 255] and truncate, the same conversion every backend uses
+static unsigned char conv_clamp(float sum) {
+    sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+    return (unsigned char)sum;
+}
+
+// Interior samples without SIMD, one fmaf per non-zero tap. Adding a zero
+// product leaves a sum unchanged, so skipping those taps changes no result.
+void conv_samples_scalar(const unsigned char *const *rows, unsigned char *out,
+                         int s_begin, int s_end, int channels, const KERNEL *kernel) {
+    int offset = (kernel->width / 2) * channels;
+
+    for (int s = s_begin; s < s_end; s++) {
+        float sum = 0.0f;
+        for (int ky = 0; ky < kernel->height; ky++) {
+            if (!rows[ky]) continue;  // Zero padding above and below the image
+
+            const unsigned char *in = rows[ky] + s - offset;
+            const float *k = kernel->values + ky * kernel->width;
+            for (int kx = 0; kx < kernel->width; kx++) {
+                if (k[kx] != 0.0f) sum = fmaf(in[kx * channels], k[kx], sum);
+            }
+        }
+        out[s] = conv_clamp(sum);
+    }
+}
+
+// Integer sums of the fixed coefficients, half is added before dropping the fractional bits
+static void conv_samples_int_scalar(const unsigned char *const *rows, unsigned char *out,
+                                    int s_begin, int s_end, int channels, const KERNEL *kernel, int32_t half) {
+    int offset = (kernel->width / 2) * channels;
+
+    for (int s = s_begin; s < s_end; s++) {
+        int32_t sum = half;
+        for (int ky = 0; ky < kernel->height; ky++) {
+            if (!rows[ky]) continue;  // Zero padding above and below the image
+
+            const unsigned char *in = rows[ky] + s - offset;
+            const int16_t *k = kernel->fixed + ky * kernel->width;
+            for (int kx = 0; kx < kernel->width; kx++) {
+                sum += in[kx * channels] * k[kx];
+            }
+        }
+        out[s] = fixed_to_byte(sum, kernel->fixed_shift);
+    }
+}
+
+// Fixed-point interior samples without SIMD
+void conv_samples_fixed_scalar(const unsigned char *const *rows, unsigned char *out,
+                               int s_begin, int s_end, int channels, const KERNEL *kernel) {
+    conv_samples_int_scalar(rows, out, s_begin, s_end, channels, kernel, (int32_t)FIXED_HALF(kernel->fixed_shift));
+}
+
+// Float interior samples of an exact kernel without SIMD: its float sums are
+// exact, so truncating the integer sum gives the same bytes
+static void conv_samples_exact_scalar(const unsigned char *const *rows, unsigned char *out,
+                                      int s_begin, int s_end, int channels, const KERNEL *kernel) {
+    conv_samples_int_scalar(rows, out, s_begin, s_end, channels, kernel, 0);
+}
+
+#ifdef CONV_X86_SIMD
+
+// 8 samples widened from bytes to floats
+__attribute__((target("avx2,fma")))
+static inline __m256 load8_ps(const unsigned char *p) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p)));
+}
+
+// AVX2: 32 samples (about 10 BGR pixels) per iteration in four accumulators.
+// Samples of one channel are channels bytes apart, so the interleaved row is
+// convolved as a flat byte array and no deinterleave is needed. sparse is a
+// constant in each instance below: skipping zero taps only pays off when
+// there are some, testing for them costs dense kernels about 15%.
+__attribute__((target("avx2,fma"), always_inline))
+static inline void conv_samples_avx2_body(const unsigned char *const *rows, unsigned char *out,
+                                          int s_begin, int s_end, int channels, const KERNEL *kernel,
+                                          const int sparse) {
+    int offset = (kernel->width / 2) * channels;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 max = _mm256_set1_ps(255.0f);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int s = s_begin;
+
+    for (; s < s_end && s_end - s_begin >= 32; s += 32) {
+        // The last vector ends at s_end, the samples it overlaps get the same values again
+        if (s + 32 > s_end) s = s_end - 32;
+        __m256 acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+        for (int ky = 0; ky < kernel->height; ky++) {
+            if (!rows[ky]) continue;  // Zero padding above and below the image
+
+            const unsigned char *in = rows[ky] + s - offset;
+            const float *k = kernel->values + ky * kernel->width;
+            for (int kx = 0; kx < kernel->width; kx++) {
+                if (sparse && k[kx] == 0.0f) continue;
+
+                const unsigned char *p = in + kx * channels;
+                __m256 weight = _mm256_set1_ps(k[kx]);
+                acc0 = _mm256_fmadd_ps(load8_ps(p), weight, acc0);
+                acc1 = _mm256_fmadd_ps(load8_ps(p + 8), weight, acc1);
+                acc2 = _mm256_fmadd_ps(load8_ps(p + 16), weight, acc2);
+                acc3 = _mm256_fmadd_ps(load8_ps(p + 24), weight, acc3);
+            }
+        }
+
+        // Clamp in float, truncate, then pack 32-bit -> 16-bit -> 8-bit
+        __m256i i0 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(acc0, zero), max));
+        __m256i i1 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(acc1, zero), max));
+        __m256i i2 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(acc2, zero), max));
+        __m256i i3 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(acc3, zero), max));
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(i0, i1), _mm256_packs_epi32(i2, i3));
+
+        // The packs work per 128-bit lane, restore sample order
+        _mm256_storeu_si256((__m256i*)(out + s), _mm256_permutevar8x32_epi32(packed, order));
+    }
+
+    conv_samples_scalar(rows, out, s, s_end, channels, kernel);
+}
+
+__attribute__((target("avx2,fma")))
+static void conv_samples_avx2(const unsigned char *const *rows, unsigned char *out,
+                              int s_begin, int s_end, int channels, const KERNEL *kernel) {
+    conv_samples_avx2_body(rows, out, s_begin, s_end, channels, kernel, 0);
+}
+
+// AVX2 for kernels with zero taps, such as sharpening
+__attribute__((target("avx2,fma")))
+static void conv_samples_sparse_avx2(const unsigned char *const *rows, unsigned char *out,
+                                     int s_begin, int s_end, int channels, const KERNEL *kernel) {
+    conv_samples_avx2_body(rows, out, s_begin, s_end, channels, kernel, 1);
+}
+
+// 16 samples widened from bytes to floats
+__attribute__((target("avx512f,fma")))
+static inline __m512 load16_ps(const unsigned char *p) {
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)p)));
+}
+
+// AVX-512: 64 samples (about 21 BGR pixels) per iteration in four accumulators
+__attribute__((target("avx512f,fma"), always_inline))
+static inline void conv_samples_avx512_body(const unsigned char *const *rows, unsigned char *out,
+                                            int s_begin, int s_end, int channels, const KERNEL *kernel,
+                                            const int sparse) {
+    int offset = (kernel->width / 2) * channels;
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 max = _mm512_set1_ps(255.0f);
+    int s = s_begin;
+
+    for (; s < s_end && s_end - s_begin >= 64; s += 64) {
+        // The last vector ends at s_end, the samples it overlaps get the same values again
+        if (s + 64 > s_end) s = s_end - 64;
+        __m512 acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+        for (int ky = 0; ky < kernel->height; ky++) {
+            if (!rows[ky]) continue;  // Zero padding above and below the image
+
+            const unsigned char *in = rows[ky] + s - offset;
+            const float *k = kernel->values + ky * kernel->width;
+            for (int kx = 0; kx < kernel->width; kx++) {
+                if (sparse && k[kx] == 0.0f) continue;
+
+                const unsigned char *p = in + kx * channels;
+                __m512 weight = _mm512_set1_ps(k[kx]);
+                acc0 = _mm512_fmadd_ps(load16_ps(p), weight, acc0);
+                acc1 = _mm512_fmadd_ps(load16_ps(p + 16), weight, acc1);
+                acc2 = _mm512_fmadd_ps(load16_ps(p + 32), weight, acc2);
+                acc3 = _mm512_fmadd_ps(load16_ps(p + 48), weight, acc3);
+            }
+        }
+
+        // Clamp in float, truncate, then narrow each accumulator to 16 bytes
+        __m512i i0 = _mm512_cvttps_epi32(_mm512_min_ps(_mm512_max_ps(acc0, zero), max));
+        __m512i i1 = _mm512_cvttps_epi32(_mm512_min_ps(_mm512_max_ps(acc1, zero), max));
+        __m512i i2 = _mm512_cvttps_epi32(_mm512_min_ps(_mm512_max_ps(acc2, zero), max));
+        __m512i i3 = _mm512_cvttps_epi32(_mm512_min_ps(_mm512_max_ps(acc3, zero), max));
+        _mm_storeu_si128((__m128i*)(out + s), _mm512_cvtusepi32_epi8(i0));
+        _mm_storeu_si128((__m128i*)(out + s + 16), _mm512_cvtusepi32_epi8(i1));
+        _mm_storeu_si128((__m128i*)(out + s + 32), _mm512_cvtusepi32_epi8(i2));
+        _mm_storeu_si128((__m128i*)(out + s + 48), _mm512_cvtusepi32_epi8(i3));
+    }
+
+    if (sparse) {
+        conv_samples_sparse_avx2(rows, out, s, s_end, channels, kernel);
+    } else {
+        conv_samples_avx2(rows, out, s, s_end, channels, kernel);
+    }
+}
+
+__attribute__((target("avx512f,fma")))
+static void conv_samples_avx512(const unsigned char *const *rows, unsigned char *out,
+                                int s_begin, int s_end, int channels, const KERNEL *kernel) {
+    conv_samples_avx512_body(rows, out, s_begin, s_end, channels, kernel, 0);
+}
+
+__attribute__((target("avx512f,fma")))
+static void conv_samples_sparse_avx512(const unsigned char *const *rows, unsigned char *out,
+                                       int s_begin, int s_end, int channels, const KERNEL *kernel) {
+    conv_samples_avx512_body(rows, out, s_begin, s_end, channels, kernel, 1);
+}
+
+// Non-zero tap of the integer loops: where it reads in the current row
+typedef struct {
+    const unsigned char *in;
+} CONV_TAP;
+
+// Taps of the integer loops kept on the stack, larger kernels allocate them
+#define CONV_STACK_TAPS 256
+
+// Sum of the 32 samples at s of taps [begin, end) as two vectors of 16-bit words
+__attribute__((target("avx2")))
+static inline void conv_group_sum(const CONV_TAP *taps, int begin, int end, int s, __m256i *lo, __m256i *hi) {
+    __m256i sum0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(taps[begin].in + s)));
+    __m256i sum1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(taps[begin].in + s + 16)));
+    for (int t = begin + 1; t < end; t++) {
+        sum0 = _mm256_add_epi16(sum0, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(taps[t].in + s))));
+        sum1 = _mm256_add_epi16(sum1, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(taps[t].in + s + 16))));
+    }
+    *lo = sum0;
+    *hi = sum1;
+}
+
+// Integer loop over groups [0, groups) of taps, returns where the scalar tail
+// starts. grouped is a constant in each instance: kernels without repeated
+// weights load single taps directly instead of summing groups.
+__attribute__((target("avx2"), always_inline))
+static inline int conv_int_avx2_loop(const CONV_TAP *taps, const int *bounds, const int32_t *pairs, int groups,
+                                     unsigned char *out, int s_begin, int s_end, int32_t half, int fixed_shift,
+                                     const int grouped) {
+    const __m256i rounding = _mm256_set1_epi32(half);
+    const __m128i shift = _mm_cvtsi32_si128(fixed_shift);
+    int s = s_begin;
+
+    for (; s < s_end && s_end - s_begin >= 32; s += 32) {
+        // The last vector ends at s_end, the samples it overlaps get the same values again
+        if (s + 32 > s_end) s = s_end - 32;
+        __m256i acc0 = rounding, acc1 = rounding, acc2 = rounding, acc3 = rounding;
+
+        for (int g = 0; g < groups; g += 2) {
+            __m256i weight = _mm256_set1_epi32(pairs[g / 2]);
+            __m256i a0, a1, b0, b1;
+            if (grouped) {
+                conv_group_sum(taps, bounds[g], bounds[g + 1], s, &a0, &a1);
+                conv_group_sum(taps, bounds[g + 1], bounds[g + 2], s, &b0, &b1);
+            } else {
+                // Every group is one tap
+                const unsigned char *a = taps[g].in + s;
+                const unsigned char *b = taps[g + 1].in + s;
+                a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)a));
+                b0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)b));
+                a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + 16)));
+                b1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + 16)));
+            }
+
+            // Interleave the two groups so each 32-bit lane holds (a, b)
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a0, b0), weight));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a0, b0), weight));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(a1, b1), weight));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(a1, b1), weight));
+        }
+
+        // Round by shifting, then saturate to bytes. unpacklo/unpackhi split
+        // each lane in halves, and packs per lane puts them back in order.
+        __m256i words0 = _mm256_packs_epi32(_mm256_sra_epi32(acc0, shift), _mm256_sra_epi32(acc1, shift));
+        __m256i words1 = _mm256_packs_epi32(_mm256_sra_epi32(acc2, shift), _mm256_sra_epi32(acc3, shift));
+        __m256i bytes = _mm256_packus_epi16(words0, words1);
+        _mm256_storeu_si256((__m256i*)(out + s), _mm256_permute4x64_epi64(bytes, 0xD8));
+    }
+
+    return s;
+}
+
+// Integer sums on AVX2, half is added before dropping the fractional bits.
+// Taps with equal weights, such as the mirrored taps of a symmetric kernel or
+// the eight -1 taps of edge detection, are added as 16-bit words first and
+// multiplied once. Groups are then processed in pairs with _mm256_madd_epi16,
+// which multiplies both and adds them into 32-bit sums. The groups come from
+// kernel_group_taps, so a row only looks up where its taps read. Integer sums
+// do not depend on the order of the taps, so every grouping gives the same
+// result. 32 samples per iteration.
+__attribute__((target("avx2")))
+static void conv_samples_int_avx2(const unsigned char *const *rows, unsigned char *out,
+                                  int s_begin, int s_end, int channels, const KERNEL *kernel, int32_t half) {
+    int offset = (kernel->width / 2) * channels;
+    int groups = kernel->fixed_groups;
+    const int *order = kernel->fixed_order;
+    const int *bounds = kernel->fixed_bounds;
+    const int32_t *pairs = kernel->fixed_pairs;
+
+    // Any row inside the image, for the groups the rows outside leave empty
+    const unsigned char *inside = NULL;
+    int missing = 0;
+    for (int ky = 0; ky < kernel->height; ky++) {
+        if (rows[ky]) {
+            if (!inside) inside = rows[ky];
+        } else {
+            missing = 1;
+        }
+    }
+    if (!order || !inside) {
+        conv_samples_int_scalar(rows, out, s_begin, s_end, channels, kernel, half);
+        return;
+    }
+
+    int count = bounds[groups];
+    CONV_TAP stack_taps[CONV_STACK_TAPS];
+    int stack_bounds[CONV_STACK_TAPS + 1];
+    int32_t stack_pairs[CONV_STACK_TAPS / 2];
+    CONV_TAP *taps = stack_taps;
+    int *row_bounds = stack_bounds;
+    int32_t *row_pairs = stack_pairs;
+    if (count > CONV_STACK_TAPS) {
+        taps = (CONV_TAP*)malloc(sizeof(*taps) * count);
+        row_bounds = (int*)malloc(sizeof(*row_bounds) * (groups + 1));
+        row_pairs = (int32_t*)malloc(sizeof(*row_pairs) * (groups / 2));
+        if (!taps || !row_bounds || !row_pairs) {
+            free(taps);
+            free(row_bounds);
+            free(row_pairs);
+            conv_samples_int_scalar(rows, out, s_begin, s_end, channels, kernel, half);
+            return;
+        }
+    }
+
+    if (!missing) {
+        for (int t = 0; t < count; t++) {
+            int i = order[t];
+            taps[t].in = rows[i / kernel->width] + (i % kernel->width) * channels - offset;
+        }
+    } else {
+        // Zero padding above or below the image: its taps are dropped, and a
+        // group left empty reads a row inside the image under a zero weight
+        int n = 0;
+        for (int g = 0; g < groups; g++) {
+            row_bounds[g] = n;
+            for (int t = bounds[g]; t < bounds[g + 1]; t++) {
+                int i = order[t];
+                const unsigned char *row = rows[i / kernel->width];
+                if (row) taps[n++].in = row + (i % kernel->width) * channels - offset;
+            }
+            if (g % 2 == 0) row_pairs[g / 2] = pairs[g / 2];
+            if (n == row_bounds[g]) {
+                taps[n++].in = inside;
+                row_pairs[g / 2] = (int32_t)((uint32_t)row_pairs[g / 2] & (g % 2 ? 0x0000FFFFu : 0xFFFF0000u));
+            }
+        }
+        row_bounds[groups] = n;
+        bounds = row_bounds;
+        pairs = row_pairs;
+    }
+
+    // When every group is one tap, the taps are loaded directly
+    int s = bounds[groups] > groups
+        ? conv_int_avx2_loop(taps, bounds, pairs, groups, out, s_begin, s_end, half, kernel->fixed_shift, 1)
+        : conv_int_avx2_loop(taps, bounds, pairs, groups, out, s_begin, s_end, half, kernel->fixed_shift, 0);
+
+    // GCC misses this on some paths, and SSE code after dirty upper halves,
+    // such as the float border pixels, runs several times slower
+    _mm256_zeroupper();
+
+    if (taps != stack_taps) {
+        free(taps);
+        free(row_bounds);
+        free(row_pairs);
+    }
+
+    conv_samples_int_scalar(rows, out, s, s_end, channels, kernel, half);
+}
+
+// Fixed point on AVX2
+__attribute__((target("avx2")))
+static void conv_samples_fixed_avx2(const unsigned char *const *rows, unsigned char *out,
+                                    int s_begin, int s_end, int channels, const KERNEL *kernel) {
+    conv_samples_int_avx2(rows, out, s_begin, s_end, channels, kernel, (int32_t)FIXED_HALF(kernel->fixed_shift));
+}
+
+// Float samples of an exact kernel on AVX2, truncating the integer sums
+__attribute__((target("avx2")))
+static void conv_samples_exact_avx2(const unsigned char *const *rows, unsigned char *out,
+                                    int s_begin, int s_end, int channels, const KERNEL *kernel) {
+    conv_samples_int_avx2(rows, out, s_begin, s_end, channels, kernel, 0);
+}
+
+#endif
+
+// Highest level supported by this CPU, or the level set by conv_set_simd_level
+SIMD_LEVEL conv_simd_level(void) {
+    if (simd_level < 0) {
+        int level = SIMD_SCALAR;
+#ifdef CONV_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) level = SIMD_AVX2;
+        if (level == SIMD_AVX2 && __builtin_cpu_supports("avx512f")) level = SIMD_AVX512;
+#endif
+        simd_level = level;
+    }
+    return (SIMD_LEVEL)simd_level;
+}
+
+// Limit the direct convolution loop to the given level
+void conv_set_simd_level(SIMD_LEVEL level) {
+    simd_level = -1;
+    if (level < conv_simd_level()) simd_level = level;
+}
+
+// Best fixed-point interior routine for the active SIMD level
+CONV_SAMPLES_FN conv_samples_fixed_dispatch(void) {
+#ifdef CONV_X86_SIMD
+    if (conv_simd_level() >= SIMD_AVX2) return conv_samples_fixed_avx2;
+#endif
+    return conv_samples_fixed_scalar;
+}
+
+// Best interior routine for the active SIMD level and the shape of the kernel
+CONV_SAMPLES_FN conv_samples_dispatch(const KERNEL *kernel) {
+    // Exact kernels give the same bytes on integer sums, which are cheaper
+    if (kernel->exact) {
+#ifdef CONV_X86_SIMD
+        if (conv_simd_level() >= SIMD_AVX2) return conv_samples_exact_avx2;
+#endif
+        return conv_samples_exact_scalar;
+    }
+
+    int sparse = kernel->taps < kernel->width * kernel->height;
+    switch (conv_simd_level()) {
+#ifdef CONV_X86_SIMD
+    case SIMD_AVX512:
+        return sparse ? conv_samples_sparse_avx512 : conv_samples_avx512;
+    case SIMD_AVX2:
+        return sparse ? conv_samples_sparse_avx2 : conv_samples_avx2;
+#endif
+    default:
+        return conv_samples_scalar;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef CONVOLUTION_SIMD_H
+#define CONVOLUTION_SIMD_H
+
+#include "convolution.h"
+
+// Convolve interior samples [s_begin, s_end) of one output row, where every
+// tap of the kernel lies inside the row. Sample s of kernel row ky reads
+// rows[ky][s + (kx - radius_x) * channels]; NULL rows read as zero.
+// All variants accumulate with one fused multiply-add per tap in the same
+// order, so they produce bit-identical output.
+typedef void (*CONV_SAMPLES_FN)(const unsigned char *const *rows, unsigned char *out,
+                                int s_begin, int s_end, int channels, const KERNEL *kernel);
+
+void conv_samples_scalar(const unsigned char *const *rows, unsigned char *out,
+                         int s_begin, int s_end, int channels, const KERNEL *kernel);
+
+// Fixed-point interior samples, exact integer arithmetic on every level
+void conv_samples_fixed_scalar(const unsigned char *const *rows, unsigned char *out,
+                               int s_begin, int s_end, int channels, const KERNEL *kernel);
+
+// Best interior routine for the active SIMD level and the kernel: exact
+// kernels (see kernel_classify) run on integer sums, with the same bytes
+CONV_SAMPLES_FN conv_samples_dispatch(const KERNEL *kernel);
+
+// Best fixed-point interior routine for the active SIMD level
+CONV_SAMPLES_FN conv_samples_fixed_dispatch(void);
+
+#endif
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fft.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Smallest power of two that is at least n
+int fft_size(int n) {
+    int size = 1;
+    while (size < n) size <<= 1;
+    return size;
+}
+
+// Build the tables for n points, returns 1 on success
+int fft_plan_init(FFT_PLAN *plan, int n) {
+    plan->n = n;
+    plan->reverse = (int*)malloc(sizeof(int) * n);
+    plan->twiddle = (FFT_COMPLEX*)malloc(sizeof(FFT_COMPLEX) * (n / 2 + 1));
+    if (!plan->reverse || !plan->twiddle) {
+        fft_plan_free(plan);
+        return 0;
+    }
+
+    int bits = 0;
+    while ((1 << bits) < n) bits++;
+    for (int i = 0; i < n; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+        plan->reverse[i] = r;
+    }
+
+    for (int k = 0; k < n / 2; k++) {
+        plan->twiddle[k].re = cos(-2.0 * M_PI * k / n);
+        plan->twiddle[k].im = sin(-2.0 * M_PI * k / n);
+    }
+    return 1;
+}
+
+// Free the tables of a plan
+void fft_plan_free(FFT_PLAN *plan) {
+    free(plan->reverse);
+    free(plan->twiddle);
+    plan->reverse = NULL;
+    plan->twiddle = NULL;
+}
+
+// Radix-2 transform of every column of plan->n rows of width points, the
+// butterflies combine whole rows
+static void fft_columns(const FFT_PLAN *plan, FFT_COMPLEX *data, int width, int inverse) {
+    int n = plan->n;
+    double sign = inverse ? -1.0 : 1.0;
+
+    for (int i = 0; i < n; i++) {
+        int j = plan->reverse[i];
+        if (i >= j) continue;
+
+        FFT_COMPLEX *a = data + (size_t)i * width;
+        FFT_COMPLEX *b = data + (size_t)j * width;
+        for (int x = 0; x < width; x++) {
+            FFT_COMPLEX t = a[x];
+            a[x] = b[x];
+            b[x] = t;
+        }
+    }
+
+    for (int len = 2; len <= n; len <<= 1) {
+        int half = len / 2;
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < half; k++) {
+                FFT_COMPLEX w = plan->twiddle[k * step];
+                double w_im = sign * w.im;
+                FFT_COMPLEX *a = data + (size_t)(i + k) * width;
+                FFT_COMPLEX *b = data + (size_t)(i + k + half) * width;
+                for (int x = 0; x < width; x++) {
+                    double re = b[x].re * w.re - b[x].im * w_im;
+                    double im = b[x].im * w.re + b[x].re * w_im;
+                    b[x].re = a[x].re - re;
+                    b[x].im = a[x].im - im;
+                    a[x].re += re;
+                    a[x].im += im;
+                }
+            }
+        }
+    }
+}
+
+// Copy rows x columns points to columns x rows points, in tiles that stay in cache
+static void fft_transpose(const FFT_COMPLEX *in, FFT_COMPLEX *out, int rows, int columns) {
+    const int tile = 16;
+    for (int y0 = 0; y0 < rows; y0 += tile) {
+        for (int x0 = 0; x0 < columns; x0 += tile) {
+            for (int y = y0; y < y0 + tile && y < rows; y++) {
+                for (int x = x0; x < x0 + tile && x < columns; x++) {
+                    out[(size_t)x * rows + y] = in[(size_t)y * columns + x];
+                }
+            }
+        }
+    }
+}
+
+// Transform the columns, transpose, then transform the columns again, so
+// every butterfly runs over whole contiguous rows
+void fft_2d(const FFT_PLAN *plan_x, const FFT_PLAN *plan_y, FFT_COMPLEX *data, FFT_COMPLEX *scratch, int inverse) {
+    const FFT_PLAN *first = inverse ? plan_x : plan_y;
+    const FFT_PLAN *second = inverse ? plan_y : plan_x;
+    size_t points = (size_t)first->n * second->n;
+
+    fft_columns(first, data, second->n, inverse);
+    fft_transpose(data, scratch, first->n, second->n);
+    fft_columns(second, scratch, first->n, inverse);
+    memcpy(data, scratch, sizeof(FFT_COMPLEX) * points);
+}
@@ -0,0 +1,41 @@
+#ifndef FFT_H
+#define FFT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Complex sample of a transform
+typedef struct {
+    double re;
+    double im;
+} FFT_COMPLEX;
+
+// Tables for transforms of n points, n a power of two
+typedef struct {
+    int n;
+    int *reverse;           // Bit-reversed order of the n points
+    FFT_COMPLEX *twiddle;   // e^(-2 pi i k / n) for k < n / 2
+} FFT_PLAN;
+
+// Smallest power of two that is at least n
+int fft_size(int n);
+
+// Build the tables for n points, n a power of two, returns 1 on success
+int fft_plan_init(FFT_PLAN *plan, int n);
+
+// Free the tables of a plan
+void fft_plan_free(FFT_PLAN *plan);
+
+// 2D transform in place of plan_y->n rows of plan_x->n points. The forward
+// transform leaves the spectrum transposed, plan_x->n rows of plan_y->n
+// points, which is the layout the inverse takes and turns back into rows.
+// Pointwise products of spectra do not depend on the layout. The inverse is
+// not divided by the number of points. scratch holds as many points as data.
+void fft_2d(const FFT_PLAN *plan_x, const FFT_PLAN *plan_y, FFT_COMPLEX *data, FFT_COMPLEX *scratch, int inverse);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
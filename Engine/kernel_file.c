@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernel_file.h"
+
+// Whole contents of a file as a string, NULL if it cannot be read
+static char *read_text_file(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *text = size >= 0 ? (char*)malloc((size_t)size + 1) : NULL;
+    if (text) {
+        size_t got = fread(text, 1, (size_t)size, file);
+        text[got] = '\0';
+    }
+    fclose(file);
+    return text;
+}
+
+// Skip separators and comments, returns the next character that is part of a token
+static const char *skip_separators(const char *p) {
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' || *p == ',') p++;
+        if (*p != '#') return p;
+        while (*p && *p != '\n') p++;  // Comment to the end of the line
+    }
+}
+
+// Read the next number into *value, returns 1 on success and moves *p past it
+static int read_number(const char **p, double *value) {
+    const char *start = skip_separators(*p);
+    char *end;
+    *value = strtod(start, &end);
+    if (end == start) return 0;
+    *p = end;
+    return 1;
+}
+
+// Parse the kernel text, returns 1 on success
+static int kernel_parse(const char *text, int *width, int *height, float **values) {
+    const char *p = text;
+    double w, h;
+    if (!read_number(&p, &w) || !read_number(&p, &h)) {
+        printf("Error: Kernel must start with its width and height.\n");
+        return 0;
+    }
+    if (w != (int)w || h != (int)h || w < 1 || h < 1 || w > KERNEL_MAX_SIZE || h > KERNEL_MAX_SIZE ||
+        (int)w % 2 == 0 || (int)h % 2 == 0) {
+        printf("Error: Kernel width and height must be odd and at most %d.\n", KERNEL_MAX_SIZE);
+        return 0;
+    }
+
+    int count = (int)w * (int)h;
+    float *v = (float*)malloc(sizeof(float) * count);
+    if (!v) {
+        printf("Error: Failed to allocate memory for kernel.\n");
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        double value;
+        if (!read_number(&p, &value)) {
+            printf("Error: Kernel has %d of its %d coefficients.\n", i, count);
+            free(v);
+            return 0;
+        }
+        v[i] = (float)value;
+    }
+
+    // Optional divisor, divided in double so 1/9 gives the same float as 1.0f / 9.0f
+    p = skip_separators(p);
+    if (*p == '/') {
+        p++;
+        double divisor;
+        if (!read_number(&p, &divisor) || divisor == 0.0) {
+            printf("Error: Kernel divisor must be a non-zero number.\n");
+            free(v);
+            return 0;
+        }
+        for (int i = 0; i < count; i++) v[i] = (float)(v[i] / divisor);
+        p = skip_separators(p);
+    }
+
+    if (*p) {
+        printf("Error: Unexpected text after kernel coefficients: %.20s\n", p);
+        free(v);
+        return 0;
+    }
+
+    *width = (int)w;
+    *height = (int)h;
+    *values = v;
+    return 1;
+}
+
+// Read a kernel from a file, or from spec itself when it names no file
+int kernel_read(const char *spec, int *width, int *height, float **values) {
+    char *text = read_text_file(spec);
+
+    // Text that does not start with a number was meant as a file name
+    const char *p = spec;
+    double first;
+    if (!text && !read_number(&p, &first)) {
+        printf("Error: Failed to open kernel file %s.\n", spec);
+        return 0;
+    }
+
+    int ok = kernel_parse(text ? text : spec, width, height, values);
+    free(text);
+    return ok;
+}
@@ -0,0 +1,35 @@
+#ifndef KERNEL_FILE_H
+#define KERNEL_FILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Largest kernel side kernel_read accepts
+#define KERNEL_MAX_SIZE 255
+
+// Read a kernel given as text: its width and height, both odd, then
+// width * height coefficients row by row, optionally followed by "/ divisor"
+// that every coefficient is divided by. Numbers are separated by spaces,
+// commas or new lines and "#" starts a comment, so a 5x5 Gaussian can be
+// written as
+//
+//     5 5
+//     1  4  6  4 1
+//     4 16 24 16 4
+//     6 24 36 24 6
+//     4 16 24 16 4
+//     1  4  6  4 1
+//     / 256
+//
+// spec is the name of a file holding the text, or the text itself when no
+// such file exists, so kernels can be given on the command line as
+// "3 3 0 -1 0 -1 5 -1 0 -1 0". On success returns 1 and sets *values to a
+// malloc'd array the caller frees.
+int kernel_read(const char *spec, int *width, int *height, float **values);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
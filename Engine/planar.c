@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "planar.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PLANAR_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Allocate a planar image of the given size, returns 1 on success
+int planar_alloc(PLANAR *planar, int width, int height) {
+    planar->width = width;
+    planar->height = height;
+    planar->stride = (width + 63) & (~63);
+    planar->data = (unsigned char*)calloc((size_t)planar->stride * height * PLANAR_CHANNELS, 1);
+
+    if (!planar->data) {
+        printf("Error: Failed to allocate memory for planar image.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Free the samples of a planar image
+void planar_free(PLANAR *planar) {
+    free(planar->data);
+    planar->data = NULL;
+}
+
+// Allocate both buffers of a ping-pong pair, returns 1 on success
+int pingpong_alloc(PLANAR_PINGPONG *pair, int width, int height) {
+    pair->current = 0;
+    if (!planar_alloc(&pair->buffers[0], width, height)) return 0;
+    if (!planar_alloc(&pair->buffers[1], width, height)) {
+        planar_free(&pair->buffers[0]);
+        return 0;
+    }
+    return 1;
+}
+
+// Free both buffers of a ping-pong pair
+void pingpong_free(PLANAR_PINGPONG *pair) {
+    planar_free(&pair->buffers[0]);
+    planar_free(&pair->buffers[1]);
+}
+
+// Read-only input of the next pass, holds the latest result
+PLANAR *pingpong_src(PLANAR_PINGPONG *pair) {
+    return &pair->buffers[pair->current];
+}
+
+// Output of the next pass
+PLANAR *pingpong_dst(PLANAR_PINGPONG *pair) {
+    return &pair->buffers[1 - pair->current];
+}
+
+// Make the output of the finished pass the input of the next one
+void pingpong_swap(PLANAR_PINGPONG *pair) {
+    pair->current = 1 - pair->current;
+}
+
+// Split pixels [x_begin, width) of one BGR row
+static void split_row_scalar(const unsigned char *in, unsigned char *const *planes, int x_begin, int width) {
+    for (int x = x_begin; x < width; x++) {
+        planes[0][x] = in[x * 3];
+        planes[1][x] = in[x * 3 + 1];
+        planes[2][x] = in[x * 3 + 2];
+    }
+}
+
+// Merge pixels [x_begin, width) of one BGR row
+static void merge_row_scalar(const unsigned char *const *planes, unsigned char *out, int x_begin, int width) {
+    for (int x = x_begin; x < width; x++) {
+        out[x * 3] = planes[0][x];
+        out[x * 3 + 1] = planes[1][x];
+        out[x * 3 + 2] = planes[2][x];
+    }
+}
+
+#ifdef PLANAR_X86_SIMD
+
+// Shuffle masks for 16 pixels = 3 vectors of 16 interleaved bytes.
+// split[c][v] gathers the bytes of plane c held by input vector v,
+// merge[c][v] places the samples of plane c into output vector v.
+// Unused lanes are 0x80, which pshufb turns into zero.
+typedef struct {
+    unsigned char split[3][3][16];
+    unsigned char merge[3][3][16];
+} PLANAR_MASKS;
+
+// Interleaved byte 3 * x + c is sample x of plane c
+static void planar_masks_init(PLANAR_MASKS *masks) {
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 3; v++) {
+            for (int i = 0; i < 16; i++) {
+                int sample = 3 * i + c;
+                masks->split[c][v][i] = sample / 16 == v ? sample % 16 : 0x80;
+
+                int index = 16 * v + i;
+                masks->merge[c][v][i] = index % 3 == c ? index / 3 : 0x80;
+            }
+        }
+    }
+}
+
+// SSSE3: 16 pixels per iteration, each plane is three shuffles ORed together
+__attribute__((target("ssse3")))
+static void split_row_ssse3(const unsigned char *in, unsigned char *const *planes, int width,
+                            const PLANAR_MASKS *masks) {
+    // Keep the masks and plane pointers in registers, byte stores may alias them
+    __m128i mask[3][3];
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < 3; i++) mask[c][i] = _mm_loadu_si128((const __m128i*)masks->split[c][i]);
+    }
+    unsigned char *b = planes[0], *g = planes[1], *r = planes[2];
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)(in + x * 3));
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(in + x * 3 + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i*)(in + x * 3 + 32));
+
+        _mm_storeu_si128((__m128i*)(b + x), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, mask[0][0]),
+            _mm_shuffle_epi8(v1, mask[0][1])), _mm_shuffle_epi8(v2, mask[0][2])));
+        _mm_storeu_si128((__m128i*)(g + x), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, mask[1][0]),
+            _mm_shuffle_epi8(v1, mask[1][1])), _mm_shuffle_epi8(v2, mask[1][2])));
+        _mm_storeu_si128((__m128i*)(r + x), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, mask[2][0]),
+            _mm_shuffle_epi8(v1, mask[2][1])), _mm_shuffle_epi8(v2, mask[2][2])));
+    }
+
+    split_row_scalar(in, planes, x, width);
+}
+
+// SSSE3: 16 pixels per iteration, each output vector takes one shuffle per plane
+__attribute__((target("ssse3")))
+static void merge_row_ssse3(const unsigned char *const *planes, unsigned char *out, int width,
+                            const PLANAR_MASKS *masks) {
+    // Keep the masks and plane pointers in registers, byte stores may alias them
+    __m128i mask[3][3];
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < 3; i++) mask[c][i] = _mm_loadu_si128((const __m128i*)masks->merge[c][i]);
+    }
+    const unsigned char *b = planes[0], *g = planes[1], *r = planes[2];
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i pb = _mm_loadu_si128((const __m128i*)(b + x));
+        __m128i pg = _mm_loadu_si128((const __m128i*)(g + x));
+        __m128i pr = _mm_loadu_si128((const __m128i*)(r + x));
+
+        for (int i = 0; i < 3; i++) {
+            __m128i sum = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(pb, mask[0][i]),
+                _mm_shuffle_epi8(pg, mask[1][i])), _mm_shuffle_epi8(pr, mask[2][i]));
+            _mm_storeu_si128((__m128i*)(out + x * 3 + i * 16), sum);
+        }
+    }
+
+    merge_row_scalar(planes, out, x, width);
+}
+
+#endif
+
+// Split the pixels [x0, x1) x [y0, y1) of img into planar column x - x0, row y - y0
+void image_to_planar_tile(const IMAGE *img, PLANAR *planar, int x0, int y0, int x1, int y1) {
+#ifdef PLANAR_X86_SIMD
+    PLANAR_MASKS masks;
+    int simd = __builtin_cpu_supports("ssse3");
+    if (simd) planar_masks_init(&masks);
+#endif
+
+    for (int y = y0; y < y1; y++) {
+        const unsigned char *in = IMAGE_ROW(img, y) + x0 * 3;
+        unsigned char *planes[3];
+        for (int c = 0; c < 3; c++) planes[c] = PLANAR_ROW(planar, c, y - y0);
+
+#ifdef PLANAR_X86_SIMD
+        if (simd) {
+            split_row_ssse3(in, planes, x1 - x0, &masks);
+            continue;
+        }
+#endif
+        split_row_scalar(in, planes, 0, x1 - x0);
+    }
+}
+
+// Merge planar column x - x0, row y - y0 back into the pixels [x0, x1) x [y0, y1) of img
+void planar_to_image_tile(const PLANAR *planar, IMAGE *img, int x0, int y0, int x1, int y1) {
+#ifdef PLANAR_X86_SIMD
+    PLANAR_MASKS masks;
+    int simd = __builtin_cpu_supports("ssse3");
+    if (simd) planar_masks_init(&masks);
+#endif
+
+    for (int y = y0; y < y1; y++) {
+        unsigned char *out = IMAGE_ROW(img, y) + x0 * 3;
+        const unsigned char *planes[3];
+        for (int c = 0; c < 3; c++) planes[c] = PLANAR_ROW(planar, c, y - y0);
+
+#ifdef PLANAR_X86_SIMD
+        if (simd) {
+            merge_row_ssse3(planes, out, x1 - x0, &masks);
+            continue;
+        }
+#endif
+        merge_row_scalar(planes, out, 0, x1 - x0);
+    }
+}
+
+// Split rows [start_row, end_row) of img into planar rows [0, end_row - start_row)
+void image_to_planar(const IMAGE *img, PLANAR *planar, int start_row, int end_row) {
+    image_to_planar_tile(img, planar, 0, start_row, img->width, end_row);
+}
+
+// Merge planar rows [0, end_row - start_row) back into rows [start_row, end_row) of img
+void planar_to_image(const PLANAR *planar, IMAGE *img, int start_row, int end_row) {
+    planar_to_image_tile(planar, img, 0, start_row, img->width, end_row);
+}
@@ -0,0 +1,70 @@
+#ifndef PLANAR_H
+#define PLANAR_H
+
+#include "bmp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Planar image: the B, G and R samples are stored as three separate planes,
+// so every channel is read with unit stride
+typedef struct {
+    int width;              // Image width in pixels
+    int height;             // Image height in pixels
+    int stride;             // Bytes between rows of a plane, a multiple of 64
+    unsigned char *data;    // 3 planes of height * stride bytes, B first
+} PLANAR;
+
+#define PLANAR_CHANNELS 3
+
+// Pointer to the first sample of row y in plane c
+#define PLANAR_ROW(p, c, y) ((p)->data + ((size_t)(c) * (p)->height + (y)) * (p)->stride)
+
+// Two planar images used in turn by successive passes: every pass reads the
+// source and writes the destination, then the two swap roles. Nothing is
+// copied between passes and both buffers are reused until freed.
+typedef struct {
+    PLANAR buffers[2];
+    int current;            // Index of the buffer holding the latest result
+} PLANAR_PINGPONG;
+
+// Allocate a planar image of the given size, returns 1 on success
+int planar_alloc(PLANAR *planar, int width, int height);
+
+// Free the samples of a planar image
+void planar_free(PLANAR *planar);
+
+// Allocate both buffers of a ping-pong pair, returns 1 on success
+int pingpong_alloc(PLANAR_PINGPONG *pair, int width, int height);
+
+// Free both buffers of a ping-pong pair
+void pingpong_free(PLANAR_PINGPONG *pair);
+
+// Read-only input of the next pass, holds the latest result
+PLANAR *pingpong_src(PLANAR_PINGPONG *pair);
+
+// Output of the next pass
+PLANAR *pingpong_dst(PLANAR_PINGPONG *pair);
+
+// Make the output of the finished pass the input of the next one
+void pingpong_swap(PLANAR_PINGPONG *pair);
+
+// Split rows [start_row, end_row) of img into planar rows [0, end_row - start_row).
+// Both images must have the same width.
+void image_to_planar(const IMAGE *img, PLANAR *planar, int start_row, int end_row);
+
+// Merge planar rows [0, end_row - start_row) back into rows [start_row, end_row) of img
+void planar_to_image(const PLANAR *planar, IMAGE *img, int start_row, int end_row);
+
+// Split the pixels [x0, x1) x [y0, y1) of img into planar column x - x0, row y - y0
+void image_to_planar_tile(const IMAGE *img, PLANAR *planar, int x0, int y0, int x1, int y1);
+
+// Merge planar column x - x0, row y - y0 back into the pixels [x0, x1) x [y0, y1) of img
+void planar_to_image_tile(const PLANAR *planar, IMAGE *img, int x0, int y0, int x1, int y1);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
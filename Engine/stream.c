@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream.h"
+
+// Rows convolved per step, the window holds them and the halo around them
+#define STREAM_BAND_ROWS 256
+
+// Read image rows [y0, y1) into window rows [slot, slot + y1 - y0), returns 1 on success.
+// Rows of a bottom-up file come in order. A top-down file stores them in
+// reverse, so the block of file rows holding them is read backwards.
+static int stream_read_rows(FILE *in, long offset, int height, int top_down, IMAGE *window,
+                            int slot, int y0, int y1) {
+    if (!top_down) {
+        size_t bytes = (size_t)(y1 - y0) * window->row_padded;
+        return fread(IMAGE_ROW(window, slot), 1, bytes, in) == bytes;
+    }
+
+    if (fseek(in, offset + (long)(height - y1) * window->row_padded, SEEK_SET) != 0) return 0;
+    for (int y = y1 - 1; y >= y0; y--) {
+        if (fread(IMAGE_ROW(window, slot + y - y0), 1, window->row_padded, in) != (size_t)window->row_padded) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Run a pipeline of kernels over a BMP file a band of rows at a time, returns 1 on success
+int conv_stream_bmp(const char *src_name, const char *dst_name, const KERNEL *kernels, int num_kernels,
+                    const CONV_OPTIONS *options) {
+    // The window never holds the rows on the far side of the image
+    if (options->border == BORDER_WRAP) {
+        printf("Error: Wrapped borders cannot be streamed.\n");
+        return 0;
+    }
+
+    FILE *in = fopen(src_name, "rb");
+    if (!in) {
+        printf("Error: Failed to open BMP file.\n");
+        return 0;
+    }
+
+    int width, height, top_down;
+    if (!bmp_read_header(in, &width, &height, &top_down)) {
+        fclose(in);
+        return 0;
+    }
+
+    FILE *out = fopen(dst_name, "wb");
+    if (!out) {
+        printf("Error: Failed to save BMP file.\n");
+        fclose(in);
+        return 0;
+    }
+
+    long offset = ftell(in);
+
+    int halo = 0;
+    for (int k = 0; k < num_kernels; k++) halo += kernels[k].height / 2;
+    int capacity = STREAM_BAND_ROWS + 2 * halo < height ? STREAM_BAND_ROWS + 2 * halo : height;
+
+    IMAGE window, result;
+    window.data = result.data = NULL;
+    int ok = bmp_write_header(out, width, height, 0) &&
+             image_alloc(&window, width, capacity) && image_alloc(&result, width, capacity);
+
+    int first = 0;   // Image row held by window row 0
+    int filled = 0;  // Rows held by the window
+    for (int done = 0; ok && done < height; ) {
+        int band_end = done + STREAM_BAND_ROWS < height ? done + STREAM_BAND_ROWS : height;
+        int need = band_end + halo < height ? band_end + halo : height;
+
+        // Read on until the window holds the halo below the band
+        if (!stream_read_rows(in, offset, height, top_down, &window, filled, first + filled, need)) {
+            printf("Error: BMP file is truncated.\n");
+            ok = 0;
+            break;
+        }
+        filled = need - first;
+
+        IMAGE src = window, dst = result;
+        src.height = dst.height = filled;
+        if (!conv_pipeline_range(&src, &dst, kernels, num_kernels, options, done - first, band_end - first)) {
+            ok = 0;
+            break;
+        }
+
+        size_t bytes = (size_t)(band_end - done) * result.row_padded;
+        if (fwrite(IMAGE_ROW(&result, done - first), 1, bytes, out) != bytes) {
+            printf("Error: Failed to write BMP file.\n");
+            ok = 0;
+            break;
+        }
+        done = band_end;
+
+        // Keep only the halo above the next band
+        int drop = done - halo > first ? done - halo - first : 0;
+        memmove(window.data, IMAGE_ROW(&window, drop), (size_t)(filled - drop) * window.row_padded);
+        first += drop;
+        filled -= drop;
+    }
+
+    image_free(&window);
+    image_free(&result);
+    fclose(in);
+    if (fclose(out) != 0) ok = 0;
+    return ok;
+}
@@ -0,0 +1,24 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "convolution.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Run a pipeline of kernels over a BMP file and write the result to another
+// file, a band of rows at a time. Rows are read into a window that holds one
+// band plus the halo of the pipeline above and below it, and each band is
+// written out as soon as it is done, so memory use depends on the width and
+// the kernels but not on the height. The output file is the same as
+// load_bmp, conv_pipeline and save_bmp would write. BORDER_WRAP needs the
+// whole image and is not supported. Returns 1 on success.
+int conv_stream_bmp(const char *src_name, const char *dst_name, const KERNEL *kernels, int num_kernels,
+                    const CONV_OPTIONS *options);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+// Tasks [begin, end) of a group, the unit kept in the deques
+typedef struct {
+    TASK_GROUP *group;
+    int begin;
+    int end;
+} POOL_RANGE;
+
+// Ring buffer of ranges. The owner pushes and pops at the bottom,
+// thieves take from the top where the oldest and largest ranges are.
+typedef struct {
+    pthread_mutex_t lock;
+    POOL_RANGE *ranges;
+    int capacity;
+    int top;                    // Index of the oldest range
+    int count;
+} POOL_DEQUE;
+
+// Deque 0 is shared by threads outside the pool, worker i owns deque i + 1
+struct THREAD_POOL {
+    pthread_mutex_t lock;       // Guards sleeping and waking
+    pthread_cond_t work;        // Signalled when a range is queued, a group finishes or the pool stops
+    pthread_t threads[POOL_MAX_THREADS];
+    int num_threads;            // Atomic, workers whose deques may be stolen from
+    int queued;                 // Atomic, ranges in all deques
+    int sleeping;               // Atomic, threads waiting for work
+    int stop;
+    POOL_DEQUE deques[POOL_MAX_THREADS + 1];
+};
+
+// Worker start argument
+typedef struct {
+    THREAD_POOL *pool;
+    int home;
+} POOL_WORKER;
+
+static THREAD_POOL *shared_pool = NULL;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to push a range to the bottom of a deque, returns 1 on success
+static int deque_push(POOL_DEQUE *deque, POOL_RANGE range) {
+    int ok = 1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        int capacity = deque->capacity ? deque->capacity * 2 : 64;
+        POOL_RANGE *ranges = (POOL_RANGE*)malloc(sizeof(POOL_RANGE) * capacity);
+        if (!ranges) {
+            ok = 0;
+        } else {
+            // Unwrap the ring into the new buffer
+            for (int i = 0; i < deque->count; i++) {
+                ranges[i] = deque->ranges[(deque->top + i) % deque->capacity];
+            }
+            free(deque->ranges);
+            deque->ranges = ranges;
+            deque->capacity = capacity;
+            deque->top = 0;
+        }
+    }
+    if (ok) {
+        deque->ranges[(deque->top + deque->count) % deque->capacity] = range;
+        deque->count++;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return ok;
+}
+
+// Function to take the newest range of a deque, returns 1 if there was one
+static int deque_pop(POOL_DEQUE *deque, POOL_RANGE *range) {
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        *range = deque->ranges[(deque->top + deque->count) % deque->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Function to take the oldest range of a deque, returns 1 if there was one
+static int deque_steal(POOL_DEQUE *deque, POOL_RANGE *range) {
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        *range = deque->ranges[deque->top];
+        deque->top = (deque->top + 1) % deque->capacity;
+        deque->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Function to queue a range on deque home and wake a sleeping worker, returns 1 on success
+static int pool_push(THREAD_POOL *pool, int home, POOL_RANGE range) {
+    if (!deque_push(&pool->deques[home], range)) return 0;
+
+    // Publishing queued before reading sleeping pairs with the worker doing
+    // the opposite under the lock, so a worker cannot sleep through this range
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return 1;
+}
+
+// Function to find a range: our own newest first, then the oldest of another deque
+static int pool_take(THREAD_POOL *pool, int home, POOL_RANGE *range) {
+    if (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0) return 0;
+
+    int found = deque_pop(&pool->deques[home], range);
+    int num_deques = __atomic_load_n(&pool->num_threads, __ATOMIC_ACQUIRE) + 1;
+    for (int i = 1; !found && i < num_deques; i++) {
+        found = deque_steal(&pool->deques[(home + i) % num_deques], range);
+    }
+
+    if (found) __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    return found;
+}
+
+// Function to run a range: halve it, leaving the upper halves for thieves, until one task is left
+static void pool_execute(THREAD_POOL *pool, int home, POOL_RANGE range) {
+    while (range.end - range.begin > 1) {
+        POOL_RANGE upper = range;
+        upper.begin = range.begin + (range.end - range.begin) / 2;
+        if (!pool_push(pool, home, upper)) break;
+        range.end = upper.begin;
+    }
+
+    TASK_GROUP *group = range.group;
+    int done = 0;
+    for (int index = range.begin; index < range.end; index++) {
+        group->fn(group->arg, index);
+        done++;
+    }
+
+    // The group may go out of scope as soon as pending reaches 0
+    if (__atomic_sub_fetch(&group->pending, done, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Worker loop: run ranges until the pool stops and the deques are empty
+static void *pool_worker(void *arg) {
+    POOL_WORKER worker = *(POOL_WORKER*)arg;
+    THREAD_POOL *pool = worker.pool;
+    free(arg);
+
+    for (;;) {
+        POOL_RANGE range;
+        if (pool_take(pool, worker.home, &range)) {
+            pool_execute(pool, worker.home, range);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        __atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        int stop = pool->stop && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) break;
+    }
+    return NULL;
+}
+
+// Start a pool with num_threads workers, at most POOL_MAX_THREADS, returns NULL on failure
+THREAD_POOL *thread_pool_create(int num_threads) {
+    THREAD_POOL *pool = (THREAD_POOL*)calloc(1, sizeof(THREAD_POOL));
+    if (!pool) {
+        printf("Error: Failed to allocate memory for thread pool.\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    for (int i = 0; i <= POOL_MAX_THREADS; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    if (!thread_pool_reserve(pool, num_threads)) {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Stop the workers and free the pool. No group may be running.
+void thread_pool_destroy(THREAD_POOL *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Join all threads
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (int i = 0; i <= POOL_MAX_THREADS; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].ranges);
+    }
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// Number of workers in the pool
+int thread_pool_size(THREAD_POOL *pool) {
+    return __atomic_load_n(&pool->num_threads, __ATOMIC_ACQUIRE);
+}
+
+// Add workers until the pool has at least num_threads, or POOL_MAX_THREADS,
+// returns 1 on success
+int thread_pool_reserve(THREAD_POOL *pool, int num_threads) {
+    int ok = 1;
+
+    // Tasks do not depend on the number of workers, so larger requests run on a full pool
+    if (num_threads > POOL_MAX_THREADS) num_threads = POOL_MAX_THREADS;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->num_threads < num_threads) {
+        POOL_WORKER *worker = (POOL_WORKER*)malloc(sizeof(POOL_WORKER));
+        if (!worker) {
+            printf("Error: Failed to allocate memory for threads.\n");
+            ok = 0;
+            break;
+        }
+        worker->pool = pool;
+        worker->home = pool->num_threads + 1;
+
+        if (pthread_create(&pool->threads[pool->num_threads], NULL, pool_worker, worker) != 0) {
+            printf("Error: Failed to create thread.\n");
+            free(worker);
+            ok = 0;
+            break;
+        }
+        // Thieves start visiting the new deque from here on
+        __atomic_store_n(&pool->num_threads, pool->num_threads + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+// Queue fn(arg, i) for every i in [0, count) and return at once
+void thread_pool_submit(THREAD_POOL *pool, TASK_GROUP *group, TASK_FN fn, void *arg, int count) {
+    group->fn = fn;
+    group->arg = arg;
+    group->pending = count > 0 ? count : 0;
+    if (count <= 0) return;
+
+    POOL_RANGE range;
+    range.group = group;
+    range.begin = 0;
+    range.end = count;
+    if (!pool_push(pool, 0, range)) {
+        // Out of memory for the deque: run the tasks here instead
+        printf("Warning: Running %d tasks on the calling thread.\n", count);
+        for (int index = 0; index < count; index++) fn(arg, index);
+        group->pending = 0;
+    }
+}
+
+// Run queued tasks of any group until every task of group has finished
+void thread_pool_wait(THREAD_POOL *pool, TASK_GROUP *group) {
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+        POOL_RANGE range;
+        if (pool_take(pool, 0, &range)) {
+            pool_execute(pool, 0, range);
+            continue;
+        }
+
+        // Nothing to take: sleep until the workers split off more or finish the group
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0 &&
+               __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        __atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Run fn(arg, i) for every i in [0, count) and return when all have finished
+void thread_pool_run(THREAD_POOL *pool, TASK_FN fn, void *arg, int count) {
+    if (count <= 0) return;
+    if (count == 1) {
+        fn(arg, 0);
+        return;
+    }
+
+    TASK_GROUP group;
+    thread_pool_submit(pool, &group, fn, arg, count);
+    thread_pool_wait(pool, &group);
+}
+
+// Process-wide pool for running num_threads tasks at once, created on first use
+THREAD_POOL *thread_pool_shared(int num_threads) {
+    int workers = num_threads > 1 ? num_threads - 1 : 0;
+
+    pthread_mutex_lock(&shared_lock);
+    if (!shared_pool) {
+        shared_pool = thread_pool_create(workers);
+    } else if (!thread_pool_reserve(shared_pool, workers)) {
+        // Keep using the workers that did start
+        printf("Warning: Running with %d pool threads.\n", thread_pool_size(shared_pool));
+    }
+    THREAD_POOL *pool = shared_pool;
+    pthread_mutex_unlock(&shared_lock);
+    return pool;
+}
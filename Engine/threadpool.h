@@ -0,0 +1,63 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Largest number of workers in one pool
+#define POOL_MAX_THREADS 256
+
+// Persistent pthread workers with work stealing. Every thread has its own
+// deque of index ranges: it splits ranges from the bottom of its deque and
+// runs them, and when the deque is empty it steals the oldest (largest)
+// range from another deque. Workers sleep between jobs and are reused across
+// images, and tasks of several images in flight are balanced together.
+typedef struct THREAD_POOL THREAD_POOL;
+
+// Task body, index is in [0, count) of the group it belongs to
+typedef void (*TASK_FN)(void *arg, int index);
+
+// Tasks submitted together with thread_pool_submit
+typedef struct {
+    TASK_FN fn;
+    void *arg;
+    int pending;            // Tasks that have not finished yet
+} TASK_GROUP;
+
+// Start a pool with num_threads workers, at most POOL_MAX_THREADS, returns NULL on failure
+THREAD_POOL *thread_pool_create(int num_threads);
+
+// Stop the workers and free the pool. No group may be running.
+void thread_pool_destroy(THREAD_POOL *pool);
+
+// Number of workers in the pool
+int thread_pool_size(THREAD_POOL *pool);
+
+// Add workers until the pool has at least num_threads, or POOL_MAX_THREADS,
+// returns 1 on success
+int thread_pool_reserve(THREAD_POOL *pool, int num_threads);
+
+// Queue fn(arg, i) for every i in [0, count) and return at once.
+// group must stay valid until thread_pool_wait returns for it.
+void thread_pool_submit(THREAD_POOL *pool, TASK_GROUP *group, TASK_FN fn, void *arg, int count);
+
+// Run queued tasks of any group until every task of group has finished
+void thread_pool_wait(THREAD_POOL *pool, TASK_GROUP *group);
+
+// Run fn(arg, i) for every i in [0, count) and return when all have finished.
+// The calling thread runs tasks too, so a pool of n workers gives n + 1 way
+// parallelism. Several threads may run jobs on the same pool at once.
+void thread_pool_run(THREAD_POOL *pool, TASK_FN fn, void *arg, int count);
+
+// Process-wide pool for running num_threads tasks at once (the caller plus
+// num_threads - 1 workers, at most POOL_MAX_THREADS), created on first use
+// and grown when needed.
+// Returns NULL when the workers cannot be started.
+THREAD_POOL *thread_pool_shared(int num_threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,54 +1,29 @@
 #include<stdio.h>
+#include<stdlib.h>
 #include<malloc.h>
 #include<pthread.h>
 #include<math.h>
 #include<stdint.h>
 #include<time.h>
+#include<sys/time.h>
+#include<string.h>
+#include<unistd.h>
 #include <stdbool.h>
 
-typedef uint8_t  BYTE;
-typedef uint32_t DWORD;
-typedef int32_t  LONG;
-typedef uint16_t WORD;
+#include "../Engine/bmp.h"
+#include "../Engine/bmp_map.h"
+#include "../Engine/boxfilter.h"
+#include "../Engine/planar.h"
+#include "../Engine/threadpool.h"
 
-typedef struct
-{
-    WORD   bfType;
-    DWORD  bfSize;
-    WORD   bfReserved1;
-    WORD   bfReserved2;
-    DWORD  bfOffBits;
-} __attribute__((__packed__))
-BITMAPFILEHEADER;
-
-typedef struct
-{
-    DWORD  biSize;
-    LONG   biWidth;
-    LONG   biHeight;
-    WORD   biPlanes;
-    WORD   biBitCount;
-    DWORD  biCompression;
-    DWORD  biSizeImage;
-    LONG   biXPelsPerMeter;
-    LONG   biYPelsPerMeter;
-    DWORD  biClrUsed;
-    DWORD  biClrImportant;
-} __attribute__((__packed__))
-BITMAPINFOHEADER;
-
-typedef struct
-{
-    BYTE  rgbtBlue;
-    BYTE  rgbtGreen;
-    BYTE  rgbtRed;
-} __attribute__((__packed__))
-RGBTRIPLE;
+typedef uint8_t  BYTE;
 
 typedef struct {
     int height;
     int width;
-    BYTE(*temp)[512];
+    PLANAR_PINGPONG *buffers;   // read the source planes, write the destination planes
+    int plane[3];
+    int planeCount;
     int startW;
     int startH;
     int endW;
@@ -56,579 +31,171 @@ typedef struct {
 }__attribute__((__packed__))
 PIXELTHREADARGS;
 
-void WriteRGBTRIPLE(int height, int width, BITMAPFILEHEADER bf, BITMAPINFOHEADER bi, char* offbits, RGBTRIPLE image[height][width]);
-void blurSeq(int height, int width, RGBTRIPLE image[height][width]);
-void *blurThreadPixel(void *args);
+// How the image is cut into tasks
+typedef enum {
+    PART_ROWS,      // row bands, each task blurs all three planes
+    PART_COLUMNS,   // column bands, each task blurs all three planes
+    PART_TILES,     // 2D tiles, each task blurs all three planes
+    PART_CHANNELS   // one plane per task, every plane cut into row bands
+} PARTITION;
 
-int main()
-{
-    FILE *fin = fopen("lena.bmp", "rb");
-    if(!fin) { printf("cannot open input\n"); return 0; }
+static const char *partitionNames[] = { "rows", "columns", "tiles", "channels" };
 
-    fseek(fin, 0, SEEK_END);
-    int filesize = ftell(fin);
-    if(filesize <= 54)
-    {
-        printf("wrong filesize\n");
-        return 0;
-    }
-    rewind(fin);
-
-    // Read infile's BITMAPFILEHEADER
-    BITMAPFILEHEADER bf;
-    fread(&bf, sizeof(BITMAPFILEHEADER), 1, fin);
-
-    // Read infile's BITMAPINFOHEADER
-    BITMAPINFOHEADER bi;
-    fread(&bi, sizeof(BITMAPINFOHEADER), 1, fin);
-
-    // Get image's dimensions
-    int height = abs(bi.biHeight);
-    int width = bi.biWidth;
+// Names of the BORDER_MODE values, in order
+static const char *borderNames[] = { "zero", "clamp", "mirror", "wrap", "reflect", "average" };
 
-    // Read offbits
-    char *offbits = malloc(bf.bfOffBits - 54);
-    fread(offbits, 1, bf.bfOffBits - 54, fin);
+int blur_radius = 1; // Blur over a (2r+1) x (2r+1) neighbourhood
+int blur_passes = 1; // Times the blur is applied
+BORDER_MODE blur_border = BORDER_AVERAGE; // Pixels outside the image, average = mean of the pixels inside
 
-    RGBTRIPLE(*image)[width] = calloc(height, width * sizeof(RGBTRIPLE));
-    for (int i = 0; i < height; i++)
-    {
-        // Read row into pixel array
-        fread(image[i], sizeof(RGBTRIPLE), width, fin);
-    }
+int blurSeq(const IMAGE *src, IMAGE *dst);
+int blurParallel(const IMAGE *src, IMAGE *dst, PARTITION strategy, int t_count);
+void *blurThreadPixel(void *args);
+void blurTask(void *args, int index);
+int partitionImage(PIXELTHREADARGS *args, PARTITION strategy, int t_count, int height, int width, PLANAR_PINGPONG *planes);
 
-    // divide R, G, B and
-    // Create temp arrays as we require original values
-    BYTE(*tempR)[width] = calloc(height, width * sizeof(BYTE));
-    BYTE(*tempG)[width] = calloc(height, width * sizeof(BYTE));
-    BYTE(*tempB)[width] = calloc(height, width * sizeof(BYTE));
+int main(int argc, char *argv[])
+{
+    // Usage: Project1 [threads] [rows|columns|tiles|channels] [zero|clamp|mirror|wrap|reflect|average]
+    int t_count = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if(t_count < 1) t_count = 1;
 
-    // split R,G,B to arrays
-    for (int i = 0; i < height; i++)
+    PARTITION strategy = PART_CHANNELS;
+    if(argc > 2)
     {
-        for (int j = 0; j < width; j++)
+        int found = 0;
+        for(int i = 0; i < 4; i++)
         {
-
-            tempR[i][j] = image[i][j].rgbtRed;
-            tempG[i][j] = image[i][j].rgbtGreen;
-            tempB[i][j] = image[i][j].rgbtBlue;
+            if(strcmp(argv[2], partitionNames[i]) == 0)
+            {
+                strategy = (PARTITION) i;
+                found = 1;
+            }
         }
+        if(!found) { printf("unknown partition %s\n", argv[2]); return 1; }
     }
-
-    int t_count;
-
-    t_count = 9;
-
-    printf("Using %d thread!\n", t_count);
-
-    if(t_count == 1)
+    if(argc > 3)
     {
-        blurSeq(height, width, image);
-
-        printf("Blur applied!\n");
-    }
-    else if(t_count == 3)
-    {
-        // create arguments for threads
-        PIXELTHREADARGS args[t_count];
-
-        args[0].height = height;
-        args[0].width = width;
-        args[0].temp = tempR;
-        args[0].startW = 0;
-        args[0].startH = 0;
-        args[0].endW = width;
-        args[0].endH = height;
-
-        args[1].height = height;
-        args[1].width = width;
-        args[1].temp = tempG;
-        args[1].startW = 0;
-        args[1].startH = 0;
-        args[1].endW = width;
-        args[1].endH = height;
-
-        args[2].height = height;
-        args[2].width = width;
-        args[2].temp = tempB;
-        args[2].startW = 0;
-        args[2].startH = 0;
-        args[2].endW = width;
-        args[2].endH = height;
-
-        struct timeval  tv1, tv2;
-
-        pthread_t tid[t_count];
-
-        //take start time
-        gettimeofday(&tv1, NULL);
-
-        // create threads
-        for(int t = 0; t < t_count; t++)
-        {
-            (void) pthread_create(&tid[t], NULL, blurThreadPixel, (void *) &args[t]);
-        }
-
-        // join threads
-        for(int t = 0; t < t_count; t++)
+        int found = 0;
+        for(int i = 0; i < BORDER_MODES; i++)
         {
-            (void) pthread_join(tid[0], NULL);
-        }
-
-        //take end time
-        gettimeofday(&tv2,NULL);
-
-        printf ("Elapsed time = %f seconds\n",
-            (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
-            (double) (tv2.tv_sec - tv1.tv_sec));
-
-        //merge R,G,B back to image
-        for (int i = 0; i < height; i++)
-        {
-            for (int j = 0; j < width; j++)
+            if(strcmp(argv[3], borderNames[i]) == 0)
             {
-                image[i][j].rgbtRed = tempR[i][j];
-                image[i][j].rgbtGreen = tempG[i][j];
-                image[i][j].rgbtBlue = tempB[i][j];
+                blur_border = (BORDER_MODE) i;
+                found = 1;
             }
         }
-
-        printf("Blur applied!\n");
+        if(!found) { printf("unknown border %s\n", argv[3]); return 1; }
     }
-    else if(t_count == 6)
-    {
-        // create arguments for threads
-        PIXELTHREADARGS args[t_count];
-
-        args[0].height = height;
-        args[0].width = width;
-        args[0].temp = tempR;
-        args[0].startW = 0;
-        args[0].startH = 0;
-        args[0].endW = width;
-        args[0].endH = height / 2;
-
-        args[1].height = height;
-        args[1].width = width;
-        args[1].temp = tempG;
-        args[1].startW = 0;
-        args[1].startH = 0;
-        args[1].endW = width;
-        args[1].endH = height / 2;
-
-        args[2].height = height;
-        args[2].width = width;
-        args[2].temp = tempB;
-        args[2].startW = 0;
-        args[2].startH = 0;
-        args[2].endW = width;
-        args[2].endH = height / 2;
-
-        args[3].height = height;
-        args[3].width = width;
-        args[3].temp = tempR;
-        args[3].startW = 0;
-        args[3].startH = height / 2;
-        args[3].endW = width;
-        args[3].endH = height;
-
-        args[4].height = height;
-        args[4].width = width;
-        args[4].temp = tempG;
-        args[4].startW = 0;
-        args[4].startH = height / 2;
-        args[4].endW = width;
-        args[4].endH = height;
-
-        args[5].height = height;
-        args[5].width = width;
-        args[5].temp = tempB;
-        args[5].startW = 0;
-        args[5].startH = height / 2;
-        args[5].endW = width;
-        args[5].endH = height;
-
-        struct timeval  tv1, tv2;
-
-        pthread_t tid[t_count];
-
-        //take start time
-        gettimeofday(&tv1, NULL);
-
-        // create threads
-        for(int t = 0; t < t_count; t++)
-        {
-            (void) pthread_create(&tid[t], NULL, blurThreadPixel, (void *) &args[t]);
-        }
 
-        // join threads
-        for(int t = 0; t < t_count; t++)
-        {
-            (void) pthread_join(tid[0], NULL);
-        }
+    // Map the input and output files, pixel rows are read and written in place
+    BMP_MAP in, out;
+    if(!bmp_map_read("lena.bmp", &in, BMP_MAP_POPULATE)) return 1;
 
-        //take end time
-        gettimeofday(&tv2,NULL);
-
-        printf ("Elapsed time = %f seconds\n",
-            (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
-            (double) (tv2.tv_sec - tv1.tv_sec));
-
-        //merge R,G,B back to image
-        for (int i = 0; i < height; i++)
-        {
-            for (int j = 0; j < width; j++)
-            {
-                image[i][j].rgbtRed = tempR[i][j];
-                image[i][j].rgbtGreen = tempG[i][j];
-                image[i][j].rgbtBlue = tempB[i][j];
-            }
-        }
+    // Get image's dimensions
+    int height = in.image.height;
+    int width = in.image.width;
 
-        printf("Blur applied!\n");
-    }
-    else if(t_count == 9)
+    if(!bmp_map_create("lenaout.bmp", width, height, &out, 0))
     {
-        // create arguments for threads
-        PIXELTHREADARGS args[t_count];
-
-        int divide = height / 3;
-        int dividex2 = divide * 2;
-        printf("%d\n", divide);
-        printf("%d\n", dividex2);
-
-        args[0].height = height;
-        args[0].width = width;
-        args[0].temp = tempR;
-        args[0].startW = 0;
-        args[0].startH = 0;
-        args[0].endW = width;
-        args[0].endH = divide;
-
-        args[1].height = height;
-        args[1].width = width;
-        args[1].temp = tempG;
-        args[1].startW = 0;
-        args[1].startH = 0;
-        args[1].endW = width;
-        args[1].endH = divide;
-
-        args[2].height = height;
-        args[2].width = width;
-        args[2].temp = tempB;
-        args[2].startW = 0;
-        args[2].startH = 0;
-        args[2].endW = width;
-        args[2].endH = divide;
-
-        args[3].height = height;
-        args[3].width = width;
-        args[3].temp = tempR;
-        args[3].startW = 0;
-        args[3].startH = divide;
-        args[3].endW = width;
-        args[3].endH = dividex2;
-
-        args[4].height = height;
-        args[4].width = width;
-        args[4].temp = tempG;
-        args[4].startW = 0;
-        args[4].startH = divide;
-        args[4].endW = width;
-        args[4].endH = dividex2;
-
-        args[5].height = height;
-        args[5].width = width;
-        args[5].temp = tempB;
-        args[5].startW = 0;
-        args[5].startH = divide;
-        args[5].endW = width;
-        args[5].endH = dividex2;
-
-        args[6].height = height;
-        args[6].width = width;
-        args[6].temp = tempR;
-        args[6].startW = 0;
-        args[6].startH = dividex2;
-        args[6].endW = width;
-        args[6].endH = height;
-
-        args[7].height = height;
-        args[7].width = width;
-        args[7].temp = tempG;
-        args[7].startW = 0;
-        args[7].startH = dividex2;
-        args[7].endW = width;
-        args[7].endH = height;
-
-        args[8].height = height;
-        args[8].width = width;
-        args[8].temp = tempB;
-        args[8].startW = 0;
-        args[8].startH = dividex2;
-        args[8].endW = width;
-        args[8].endH = height;
-
-        struct timeval  tv1, tv2;
-
-        pthread_t tid[t_count];
-
-        //take start time
-        gettimeofday(&tv1, NULL);
-
-        // create threads
-        for(int t = 0; t < t_count; t++)
-        {
-            (void) pthread_create(&tid[t], NULL, blurThreadPixel, (void *) &args[t]);
-        }
-
-        // join threads
-        for(int t = 0; t < t_count; t++)
-        {
-            (void) pthread_join(tid[0], NULL);
-        }
+        bmp_unmap(&in);
+        return 1;
+    }
 
-        //take end time
-        gettimeofday(&tv2,NULL);
+    printf("Using %d thread!\n", t_count);
 
-        printf ("Elapsed time = %f seconds\n",
-            (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
-            (double) (tv2.tv_sec - tv1.tv_sec));
+    int ok = t_count == 1 ? blurSeq(&in.image, &out.image)
+                          : blurParallel(&in.image, &out.image, strategy, t_count);
+    if(ok) printf("Blur applied!\n");
 
-        //merge R,G,B back to image
-        for (int i = 0; i < height; i++)
-        {
-            for (int j = 0; j < width; j++)
-            {
-                image[i][j].rgbtRed = tempR[i][j];
-                image[i][j].rgbtGreen = tempG[i][j];
-                image[i][j].rgbtBlue = tempB[i][j];
-            }
-        }
+    bmp_unmap(&in);
+    bmp_unmap(&out);
 
-        printf("Blur applied!\n");
-    }
-    else if(t_count == 12)
-    {
-        // create arguments for threads
-        PIXELTHREADARGS args[t_count];
-
-        args[0].height = height;
-        args[0].width = width;
-        args[0].temp = tempR;
-        args[0].startW = 0;
-        args[0].startH = 0;
-        args[0].endW = width / 2;
-        args[0].endH = height / 2;
-
-        args[1].height = height;
-        args[1].width = width;
-        args[1].temp = tempG;
-        args[1].startW = 0;
-        args[1].startH = 0;
-        args[1].endW = width / 2;
-        args[1].endH = height / 2;
-
-        args[2].height = height;
-        args[2].width = width;
-        args[2].temp = tempB;
-        args[2].startW = 0;
-        args[2].startH = 0;
-        args[2].endW = width / 2;
-        args[2].endH = height / 2;
-
-        args[3].height = height;
-        args[3].width = width;
-        args[3].temp = tempR;
-        args[3].startW = width / 2;
-        args[3].startH = 0;
-        args[3].endW = width;
-        args[3].endH = height / 2;
-
-        args[4].height = height;
-        args[4].width = width;
-        args[4].temp = tempG;
-        args[4].startW = width / 2;
-        args[4].startH = 0;
-        args[4].endW = width;
-        args[4].endH = height / 2;
-
-        args[5].height = height;
-        args[5].width = width;
-        args[5].temp = tempB;
-        args[5].startW = width / 2;
-        args[5].startH = 0;
-        args[5].endW = width;
-        args[5].endH = height / 2;
-
-        args[6].height = height;
-        args[6].width = width;
-        args[6].temp = tempR;
-        args[6].startW = 0;
-        args[6].startH = height / 2;
-        args[6].endW = width / 2;
-        args[6].endH = height;
-
-        args[7].height = height;
-        args[7].width = width;
-        args[7].temp = tempG;
-        args[7].startW = 0;
-        args[7].startH = height / 2;
-        args[7].endW = width / 2;
-        args[7].endH = height;
-
-        args[8].height = height;
-        args[8].width = width;
-        args[8].temp = tempB;
-        args[8].startW = 0;
-        args[8].startH = height / 2;
-        args[8].endW = width / 2;
-        args[8].endH = height;
-
-        args[9].height = height;
-        args[9].width = width;
-        args[9].temp = tempR;
-        args[9].startW = width / 2;
-        args[9].startH = height / 2;
-        args[9].endW = width;
-        args[9].endH = height;
-
-        args[10].height = height;
-        args[10].width = width;
-        args[10].temp = tempG;
-        args[10].startW = width / 2;
-        args[10].startH = height / 2;
-        args[10].endW = width;
-        args[10].endH = height;
-
-        args[11].height = height;
-        args[11].width = width;
-        args[11].temp = tempB;
-        args[11].startW = width / 2;
-        args[11].startH = height / 2;
-        args[11].endW = width;
-        args[11].endH = height;
-
-        struct timeval  tv1, tv2;
-
-        pthread_t tid[t_count];
-
-        //take start time
-        gettimeofday(&tv1, NULL);
-
-        // create threads
-        for(int t = 0; t < t_count; t++)
-        {
-            (void) pthread_create(&tid[t], NULL, blurThreadPixel, (void *) &args[t]);
-        }
+    return ok ? 0 : 1;
+}
 
-        // join threads
-        for(int t = 0; t < t_count; t++)
-        {
-            (void) pthread_join(tid[0], NULL);
-        }
+// Blur the whole image on the calling thread, returns 1 on success
+int blurSeq(const IMAGE *src, IMAGE *dst)
+{
+    struct timeval  tv1, tv2;
 
-        //take end time
-        gettimeofday(&tv2,NULL);
+    //take start time
+    gettimeofday(&tv1, NULL);
 
-        printf ("Elapsed time = %f seconds\n",
-            (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
-            (double) (tv2.tv_sec - tv1.tv_sec));
+    // Running-sum box blur: each pixel becomes the average of its
+    // neighbours. The first pass reads the input file, later passes blur the
+    // output in place, which is safe as rows are summed before they are
+    // overwritten. Borders that read rows above need a copy of the last pass.
+    int inPlace = blur_border == BORDER_ZERO || blur_border == BORDER_AVERAGE;
+    BYTE *copy = NULL;
+    if(blur_passes > 1 && !inPlace)
+    {
+        copy = malloc((size_t) src->row_padded * src->height);
+        if(!copy) { printf("Error: Failed to allocate memory for blur.\n"); return 0; }
+    }
 
-        //merge R,G,B back to image
-        for (int i = 0; i < height; i++)
+    for(int pass = 0; pass < blur_passes; pass++)
+    {
+        const BYTE *from = src->data;
+        if(pass > 0)
         {
-            for (int j = 0; j < width; j++)
-            {
-                image[i][j].rgbtRed = tempR[i][j];
-                image[i][j].rgbtGreen = tempG[i][j];
-                image[i][j].rgbtBlue = tempB[i][j];
-            }
+            if(copy) memcpy(copy, dst->data, (size_t) src->row_padded * src->height);
+            from = copy ? copy : dst->data;
         }
-
-        printf("Blur applied!\n");
+        box_blur_region(from, dst->data, src->row_padded, src->width, src->height, 3, blur_radius, blur_border,
+                        0, 0, src->width, src->height);
     }
+    free(copy);
 
-    WriteRGBTRIPLE(height, width, bf, bi, offbits, image);
-    fclose(fin);
+    //take end time
+    gettimeofday(&tv2,NULL);
 
-    return 0;
+    printf ("Elapsed time = %f seconds\n",
+         (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
+         (double) (tv2.tv_sec - tv1.tv_sec));
+
+    return 1;
 }
 
-void WriteRGBTRIPLE(int height, int width, BITMAPFILEHEADER bf, BITMAPINFOHEADER bi, char* offbits, RGBTRIPLE image[height][width])
+// Blur the whole image with t_count pool threads, returns 1 on success
+int blurParallel(const IMAGE *src, IMAGE *dst, PARTITION strategy, int t_count)
 {
-    FILE *fout = fopen("lenaout.bmp", "wb");
-    if(!fout) { printf("cannot open output\n"); return 0; }
-
-    // Write outfile's BITMAPFILEHEADER
-    fwrite(&bf, sizeof(BITMAPFILEHEADER), 1, fout);
-
-    // Write outfile's BITMAPINFOHEADER
-    fwrite(&bi, sizeof(BITMAPINFOHEADER), 1, fout);
-
-    // Write offbits
-    fwrite(offbits, 1, bf.bfOffBits - 54, fout);
-
-    // Write image
-    for (int i = 0; i < height; i++)
+    int height = src->height;
+    int width = src->width;
+
+    // Worker threads are started once and reused by every blur
+    THREAD_POOL *pool = thread_pool_shared(t_count);
+    if(!pool) return 0;
+
+    // Split R, G, B into planes
+    // Every pass reads one set of planes and writes the other, so tasks
+    // never see neighbours another task has already blurred
+    PLANAR_PINGPONG planes;
+    if(!pingpong_alloc(&planes, width, height)) return 0;
+    image_to_planar(src, pingpong_src(&planes), 0, height);
+
+    // create arguments for tasks, at most three per thread
+    PIXELTHREADARGS *args = malloc(sizeof(PIXELTHREADARGS) * t_count * 3);
+    if(!args)
     {
-        // Write row to outfile
-        fwrite(image[i], sizeof(RGBTRIPLE), width, fout);
+        printf("Error: Failed to allocate memory for tasks.\n");
+        pingpong_free(&planes);
+        return 0;
     }
+    int task_count = partitionImage(args, strategy, t_count, height, width, &planes);
 
-    fclose(fout);
-    free(image);
-}
+    printf("Partition %s, %d tasks\n", partitionNames[strategy], task_count);
 
-void blurSeq(int height, int width, RGBTRIPLE image[height][width])
-{
     struct timeval  tv1, tv2;
 
     //take start time
     gettimeofday(&tv1, NULL);
 
-    // Create temp array as we require original values
-    RGBTRIPLE temp[height][width];
-    for (int i = 0; i < height; i++)
+    // run one task per args entry on the pool threads, then swap the planes
+    for(int pass = 0; pass < blur_passes; pass++)
     {
-        for (int j = 0; j < width; j++)
-        {
-            temp[i][j] = image[i][j];
-        }
-    }
-
-    for (int i = 0; i < height; i++)
-    {
-        for (int j = 0; j < width; j++) // went to a pixel
-        {
-            // Initialise values for each i,j pixel
-            float sum_red;
-            float sum_blue;
-            float sum_green;
-            int counter; // to count no. of surr. pixels
-            sum_red = sum_blue = sum_green = counter = 0;
-
-            for (int k = i - 1; k <= i + 1; k++) // for surr. pixels
-            {
-                for (int l = j - 1; l <= j + 1; l++)
-                { // cases of surr. ipixel
-
-                    if (k >= 0 && l >= 0 && k < height && l < width)
-                    { // if that ipixel is in img.
-
-                        sum_red += temp[k][l].rgbtRed;
-                        sum_blue += temp[k][l].rgbtBlue;
-                        sum_green += temp[k][l].rgbtGreen;
-                        counter++;
-                    }
-                }
-            }
-
-            // take average
-            image[i][j].rgbtRed = round(sum_red / counter);
-            image[i][j].rgbtGreen = round(sum_green / counter);
-            image[i][j].rgbtBlue = round(sum_blue / counter);
-        }
+        thread_pool_run(pool, blurTask, args, task_count);
+        pingpong_swap(&planes);
     }
 
     //take end time
@@ -638,7 +205,12 @@ void blurSeq(int height, int width, RGBTRIPLE image[height][width])
          (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
          (double) (tv2.tv_sec - tv1.tv_sec));
 
-    return;
+    //merge R,G,B back to image
+    planar_to_image(pingpong_src(&planes), dst, 0, height);
+    free(args);
+    pingpong_free(&planes);
+
+    return 1;
 }
 
 void *blurThreadPixel(void *arg)
@@ -653,32 +225,92 @@ void *blurThreadPixel(void *arg)
     int endW = args->endW;
     int endH = args->endH;
 
-    BYTE(*temp)[width] = args->temp;
+    PLANAR *src = pingpong_src(args->buffers);
+    PLANAR *dst = pingpong_dst(args->buffers);
 
+    // Running-sum box blur of this task's part of each plane
+    for(int c = 0; c < args->planeCount; c++)
+    {
+        box_blur_region(PLANAR_ROW(src, args->plane[c], 0), PLANAR_ROW(dst, args->plane[c], 0), src->stride,
+                        width, height, 1, blur_radius, blur_border, startW, startH, endW, endH);
+    }
 
-    for (int i = startH; i < endH; i++)
+    return NULL;
+}
+
+void blurTask(void *arg, int index)
+{
+    PIXELTHREADARGS *args = arg;
+
+    blurThreadPixel(&args[index]);
+}
+
+// Start and end of part i when length is cut into count nearly equal parts
+void splitRange(int length, int count, int i, int *start, int *end)
+{
+    *start = (int) ((long) length * i / count);
+    *end = (int) ((long) length * (i + 1) / count);
+}
+
+// Fill args with the tasks of a partition and return how many there are.
+// args must have room for 3 * t_count entries.
+int partitionImage(PIXELTHREADARGS *args, PARTITION strategy, int t_count, int height, int width, PLANAR_PINGPONG *planes)
+{
+    int rows = 1, columns = 1, planesPerTask = 3;
+
+    if(strategy == PART_ROWS)
     {
-        for (int j = startW; j < endW; j++) // went to a pixel
-        {
-            // Initialise values for each i,j pixel
-            float sum;
-            int counter; // to count no. of surr. pixels
-            sum = counter = 0;
+        rows = t_count;
+    }
+    else if(strategy == PART_COLUMNS)
+    {
+        columns = t_count;
+    }
+    else if(strategy == PART_TILES)
+    {
+        // Grid with about t_count tiles that are close to square
+        rows = (int) (sqrt((double) t_count * height / width) + 0.5);
+        if(rows < 1) rows = 1;
+        if(rows > t_count) rows = t_count;
+        columns = (t_count + rows - 1) / rows;
+    }
+    else
+    {
+        // Three planes per group of bands, so t_count threads get about t_count tasks
+        rows = (t_count + 2) / 3;
+        planesPerTask = 1;
+    }
+
+    if(rows > height) rows = height;
+    if(columns > width) columns = width;
 
-            for (int k = i - 1; k <= i + 1; k++) // for surr. pixels
+    int count = 0;
+    for(int c = 0; c < 3; c += planesPerTask)
+    {
+        for(int r = 0; r < rows; r++)
+        {
+            for(int k = 0; k < columns; k++)
             {
-                for (int l = j - 1; l <= j + 1; l++)
-                { // cases of surr. ipixel
-                    if (k >= 0 && l >= 0 && k < height && l < width)
-                    { // if that ipixel is in img.
-                        sum += temp[k][l];
-                        counter++;
-                    }
+                PIXELTHREADARGS *a = &args[count++];
+                int startH, endH, startW, endW;
+
+                a->height = height;
+                a->width = width;
+                a->buffers = planes;
+                a->planeCount = planesPerTask;
+                for(int p = 0; p < planesPerTask; p++)
+                {
+                    a->plane[p] = c + p;
                 }
+                splitRange(height, rows, r, &startH, &endH);
+                splitRange(width, columns, k, &startW, &endW);
+                a->startH = startH;
+                a->endH = endH;
+                a->startW = startW;
+                a->endW = endW;
             }
-            // take average
-            temp[i][j] = round(sum / counter);
         }
     }
-}
 
+    return count;
+}
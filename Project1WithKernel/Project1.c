@@ -1,231 +1,126 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <pthread.h>
-#include <time.h>
-
-#pragma pack(push, 1)
-typedef struct {
-    unsigned short bfType;        // File type (should be 'BM')
-    unsigned int bfSize;          // Size of the file
-    unsigned short bfReserved1;
-    unsigned short bfReserved2;
-    unsigned int bfOffBits;       // Offset to the pixel data
-} BITMAPFILEHEADER;
-
-typedef struct {
-    unsigned int biSize;          // Size of the header
-    int biWidth;                  // Width of the image
-    int biHeight;                 // Height of the image
-    unsigned short biPlanes;
-    unsigned short biBitCount;    // Bits per pixel (24 for color)
-    unsigned int biCompression;
-    unsigned int biSizeImage;     // Image size
-    int biXPelsPerMeter;
-    int biYPelsPerMeter;
-    unsigned int biClrUsed;
-    unsigned int biClrImportant;
-} BITMAPINFOHEADER;
-#pragma pack(pop)
-
-unsigned char *image;    // Pointer to image data
-unsigned char *padded_image; // Pointer to zero-padded image
-int width, height;      // Image dimensions
-int channels = 3;       // Number of channels (RGB)
-unsigned int row_padded; // Row size, padded to be a multiple of 4
-int num_threads = 12;  // Number of threads to use
-/*
-// Sharpening kernel
-float kernel[3][3] = {
-    {0, -1, 0},
-    {-1, 5, -1},
-    {0, -1, 0}
-};
-*/
+#include <string.h>
+#include <sys/time.h>
 
-// Box blur kernel
-float kernel[3][3] = {
-    {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f},
-    {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f},
-    {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f}
-};
+#include "../Engine/batch.h"
+#include "../Engine/bmp.h"
+#include "../Engine/convolution.h"
+#include "../Engine/stream.h"
 
-/*
-// Edge detection kernel
-float kernel[3][3] = {
-    {-1, -1, -1},
-    {-1, 8, -1},
-    {-1, -1, -1}
-};
-*/
-// Function to load a BMP image
-int load_bmp(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        printf("Error: Failed to open BMP file.\n");
-        return 0;
+int num_threads = 12;  // Number of threads to use
+int num_stages = 1;    // Apply the first num_stages kernels in turn, 3 = blur, sharpen, edges (unless given as arguments)
+int streaming = 0;     // 1 = convolve the file a band of rows at a time, for images larger than memory
+
+// Kernels of the pipeline, in the order they are applied
+float kernels[3][3][3] = {
+    // Box blur kernel
+    {
+        {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f},
+        {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f},
+        {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f}
+    },
+    // Sharpening kernel
+    {
+        {0, -1, 0},
+        {-1, 5, -1},
+        {0, -1, 0}
+    },
+    // Edge detection kernel
+    {
+        {-1, -1, -1},
+        {-1, 8, -1},
+        {-1, -1, -1}
     }
+};
 
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
-
-    fread(&fileHeader, sizeof(BITMAPFILEHEADER), 1, file);
-    fread(&infoHeader, sizeof(BITMAPINFOHEADER), 1, file);
-
-    width = infoHeader.biWidth;
-    height = infoHeader.biHeight;
-
-    row_padded = (width * 3 + 3) & (~3);  // Row size padded to be multiple of 4
-
-    // Allocate memory for image and padded image
-    image = (unsigned char*)malloc(row_padded * height);
-    padded_image = (unsigned char*)malloc((width + 2) * 3 * (height + 2)); // Zero-padded image
-
-    if (!image || !padded_image) {
-        printf("Error: Failed to allocate memory for image.\n");
-        fclose(file);
-        return 0;
+// Free the first count kernels and the array holding them
+static void free_kernels(KERNEL *conv_kernels, int count) {
+    for (int i = 0; i < count; i++) {
+        kernel_free(&conv_kernels[i]);
     }
-
-    fseek(file, fileHeader.bfOffBits, SEEK_SET);
-    fread(image, sizeof(unsigned char), row_padded * height, file);
-
-    fclose(file);
-    return 1;
+    free(conv_kernels);
 }
 
-// Function to save a BMP image
-void save_bmp(const char *filename) {
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
-        printf("Error: Failed to save BMP file.\n");
-        return;
+// Main function to load the image, apply the kernels, and save the result.
+// Each argument replaces the built-in kernels with one stage of any odd size,
+// a kernel file or the kernel itself, e.g. "5 5 1 4 6 4 1 ... / 256" (see kernel_read).
+// "-b list outdir" first convolves every image of a directory or manifest
+// instead of lena.bmp (see conv_batch).
+int main(int argc, char *argv[]) {
+    IMAGE image, output;
+    KERNEL *conv_kernels;
+    const char *batch_list = NULL;
+    const char *batch_dir = NULL;
+    int first_kernel = 1;
+
+    if (argc > 3 && strcmp(argv[1], "-b") == 0) {
+        batch_list = argv[2];
+        batch_dir = argv[3];
+        first_kernel = 4;
     }
 
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
-
-    fileHeader.bfType = 0x4D42;  // BM
-    fileHeader.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + row_padded * height;
-    fileHeader.bfReserved1 = fileHeader.bfReserved2 = 0;
-    fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
-
-    infoHeader.biSize = sizeof(BITMAPINFOHEADER);
-    infoHeader.biWidth = width;
-    infoHeader.biHeight = height;
-    infoHeader.biPlanes = 1;
-    infoHeader.biBitCount = 24;  // 24 bits per pixel
-    infoHeader.biCompression = 0;  // No compression
-    infoHeader.biSizeImage = row_padded * height;
-    infoHeader.biXPelsPerMeter = 0;
-    infoHeader.biYPelsPerMeter = 0;
-    infoHeader.biClrUsed = 0;
-    infoHeader.biClrImportant = 0;
-
-    fwrite(&fileHeader, sizeof(BITMAPFILEHEADER), 1, file);
-    fwrite(&infoHeader, sizeof(BITMAPINFOHEADER), 1, file);
-
-    // Write the image data
-    fwrite(image, sizeof(unsigned char), row_padded * height, file);
-
-    fclose(file);
-}
-
-// Apply kernel to each color channel (Red, Green, Blue) with zero padding
-void apply_kernel_to_channels(int x, int y, unsigned char *new_pixel_values) {
-    for (int color = 0; color < 3; color++) {  // 0 = Red, 1 = Green, 2 = Blue
-        float sum = 0.0;
-
-        // Apply the kernel
-        for (int ky = -1; ky <= 1; ky++) {
-            for (int kx = -1; kx <= 1; kx++) {
-                int ix = x + kx;  // x position in the padded image
-                int iy = y + ky;  // y position in the padded image
-
-                // Zero padding: If we're out of bounds, use 0 for the pixel
-                if (ix < 0 || ix >= width) ix = 0;
-                if (iy < 0 || iy >= height) iy = 0;
-
-                // Apply the kernel to the padded image
-                int pixel_index = ((iy + 1) * (width + 2) + (ix + 1)) * 3;  // Offset by 1 for the padding
-                unsigned char pixel_value = padded_image[pixel_index + color];
-                sum += pixel_value * kernel[ky + 1][kx + 1];
-            }
-        }
-
-        // Clamp the value to ensure it's within the valid range [0, 255]
-        sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);  // Clamp the sum to the valid range
-        new_pixel_values[color] = (unsigned char)sum;
+    if (argc > first_kernel) {
+        num_stages = argc - first_kernel;
+    } else if (num_stages > (int)(sizeof kernels / sizeof kernels[0])) {
+        num_stages = sizeof kernels / sizeof kernels[0];
     }
-}
 
-// Zero padding function to create padded image
-void zero_padding() {
-    // Initialize padded image to zero
-    for (int y = 0; y < height + 2; y++) {
-        for (int x = 0; x < (width + 2) * 3; x++) {
-            padded_image[y * (width + 2) * 3 + x] = 0;
-        }
+    conv_kernels = (KERNEL*)malloc(sizeof(KERNEL) * num_stages);
+    if (!conv_kernels) {
+        printf("Error: Failed to allocate memory for kernels.\n");
+        return 1;
     }
 
-    // Copy the original image to the center of the padded image
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width * 3; x++) {
-            padded_image[(y + 1) * (width + 2) * 3 + (x + 3)] = image[y * row_padded + x];
+    for (int i = 0; i < num_stages; i++) {
+        int ok = argc > first_kernel ? kernel_load(&conv_kernels[i], argv[first_kernel + i])
+                          : kernel_init(&conv_kernels[i], 3, 3, &kernels[i][0][0]);
+        if (!ok) {
+            free_kernels(conv_kernels, i);
+            return 1;
         }
     }
-}
 
-// Thread function for applying the kernel
-void *apply_kernel_thread(void *arg) {
-    int thread_id = *(int *)arg;
-    int rows_per_thread = height / num_threads;
-    int start_row = thread_id * rows_per_thread;
-    int end_row = (thread_id == num_threads - 1) ? height : (thread_id + 1) * rows_per_thread;
-
-    // Apply kernel to the assigned rows
-    for (int y = start_row; y < end_row; y++) {
-        for (int x = 0; x < width; x++) {
-            unsigned char new_pixel_values[3];  // To store the new pixel values for R, G, B
-            apply_kernel_to_channels(x, y, new_pixel_values);
-
-            // Write the new pixel values back to the image
-            int pixel_index = (y * row_padded + x * 3);
-            image[pixel_index + 0] = new_pixel_values[0];  // Red
-            image[pixel_index + 1] = new_pixel_values[1];  // Green
-            image[pixel_index + 2] = new_pixel_values[2];  // Blue
-        }
-    }
+    // Apply the kernels on the thread pool, all stages fused per cache tile
+    CONV_OPTIONS options;
+    conv_default_options(&options);
+    options.backend = BACKEND_PTHREAD;
+    options.num_threads = num_threads;
+    options.precision = PRECISION_FLOAT;  // PRECISION_FIXED gives the same bytes on every backend
+    options.border = BORDER_ZERO;         // Pixels outside the image, see BORDER_MODE (no BORDER_WRAP when streaming)
 
-    return NULL;
-}
+    struct timeval  tv1, tv2;
+
+    if (batch_list || streaming) {
+        gettimeofday(&tv1, NULL);
+        int ok = batch_list ? conv_batch(batch_list, batch_dir, conv_kernels, num_stages, &options)
+                            : conv_stream_bmp("lena.bmp", "lenaout.bmp", conv_kernels, num_stages, &options);
+        gettimeofday(&tv2, NULL);
+
+        printf ("Elapsed time = %f seconds\n",
+            (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
+            (double) (tv2.tv_sec - tv1.tv_sec));
+
+        free_kernels(conv_kernels, num_stages);
+        return ok ? 0 : 1;
+    }
 
-// Main function to load the image, apply the kernel, and save the result
-int main() {
     // Load the BMP image
-    if (!load_bmp("lena.bmp")) {
+    if (!load_bmp("lena.bmp", &image)) {
+        free_kernels(conv_kernels, num_stages);
         return 1;
     }
 
-    // Apply zero padding to the image
-    zero_padding();
-
-    // Create pthreads to apply the kernel
-    pthread_t threads[num_threads];
-    int thread_ids[num_threads];
-    struct timeval  tv1, tv2;
+    if (!image_alloc(&output, image.width, image.height)) {
+        image_free(&image);
+        free_kernels(conv_kernels, num_stages);
+        return 1;
+    }
 
     //take start time
     gettimeofday(&tv1, NULL);
 
-    for (int i = 0; i < num_threads; i++) {
-        thread_ids[i] = i;
-        pthread_create(&threads[i], NULL, apply_kernel_thread, (void *)&thread_ids[i]);
-    }
-
-    // Join all threads
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
-    }
+    int ok = conv_pipeline(&image, &output, conv_kernels, num_stages, &options);
 
     //take end time
     gettimeofday(&tv2,NULL);
@@ -234,12 +129,13 @@ int main() {
         (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
         (double) (tv2.tv_sec - tv1.tv_sec));
 
-    // Save the processed image as BMP
-    save_bmp("lenaout.bmp");
+    // Save the processed image as BMP, unless the pipeline failed part way
+    if (ok) ok = save_bmp("lenaout.bmp", &output);
 
     // Free the image data
-    free(image);
-    free(padded_image);
+    image_free(&image);
+    image_free(&output);
+    free_kernels(conv_kernels, num_stages);
 
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -3,233 +3,598 @@
 #include <stdint.h>
 #include <mpi.h>
 #include <string.h>
-#include <time.h>
+#include <sys/time.h>
 
-// BMP Header Structures
-#pragma pack(push, 1)
+#include "../Engine/bmp.h"
+#include "../Engine/convolution.h"
 
-typedef struct {
-    uint16_t bfType;
-    uint32_t bfSize;
-    uint16_t bfReserved1;
-    uint16_t bfReserved2;
-    uint32_t bfOffBits;
-} BITMAPFILEHEADER;
+// Define the kernel (e.g., a 3x3 averaging kernel)
+float kernel[3][3] = {
+    {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f},
+    {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f},
+    {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f}
+};
+
+// What the kernel reads outside the image
+BORDER_MODE border = BORDER_ZERO;
 
+// Threads of each rank over its block, so one rank can run per socket or node.
+// Bind the ranks, e.g. mpirun --map-by socket --bind-to socket, and the
+// threads stay on the CPUs of their rank.
+BACKEND backend = BACKEND_PTHREAD;  // BACKEND_SERIAL = one thread per rank
+int num_threads = 0;                // 0 = OMP_NUM_THREADS, or every CPU the rank is bound to
+
+// 1 = every rank reads and writes its own block with MPI-IO, so no rank holds
+// the whole image; 0 = rank 0 loads, scatters, gathers and saves it
+int mpi_io = 0;
+
+// Bytes of one pixel
+#define PIXEL_SIZE 3
+
+// Part [*start, *end) of length items split into parts parts
+void split_range(int length, int parts, int index, int *start, int *end) {
+    int chunk = length / parts;
+    int remainder = length % parts;
+
+    *start = index * chunk + (index < remainder ? index : remainder);
+    *end = (index + 1) * chunk + (index + 1 < remainder ? index + 1 : remainder);
+}
+
+// Shape of the grid of ranks, dims[0] rows by dims[1] columns of blocks,
+// that swaps the fewest halo pixels over all passes. Every block must be at
+// least max_x columns wide and max_y rows high wherever it has a neighbour.
+// Returns 0 when no grid fits.
+int choose_grid(int width, int height, int size, int max_x, int max_y, int sum_x, int sum_y, int wrap,
+                int dims[2]) {
+    double best = -1.0;
+    for (int columns = 1; columns <= size; columns++) {
+        if (size % columns != 0) continue;
+        int rows = size / columns;
+        if ((rows > 1 || wrap) && height / rows < max_y) continue;
+        if ((columns > 1 || wrap) && width / columns < max_x) continue;
+
+        // Every cut between blocks moves a halo each way along its whole length
+        double cost = (double)(wrap ? rows : rows - 1) * width * sum_y +
+                      (double)(wrap ? columns : columns - 1) * height * sum_x;
+        if (best < 0.0 || cost < best) {
+            best = cost;
+            dims[0] = rows;
+            dims[1] = columns;
+        }
+    }
+    return best >= 0.0;
+}
+
+// Block of one rank: the pixels it owns, surrounded by halo rows and columns
+// received from its eight neighbours. Blocks at the image edges have no
+// neighbour there, and the kernel applies the border mode, except wrapped
+// blocks, whose neighbours are the ranks at the far side of the image.
 typedef struct {
-    uint32_t biSize;
-    int32_t biWidth;
-    int32_t biHeight;
-    uint16_t biPlanes;
-    uint16_t biBitCount;
-    uint32_t biCompression;
-    uint32_t biSizeImage;
-    int32_t biXPelsPerMeter;
-    int32_t biYPelsPerMeter;
-    uint32_t biClrUsed;
-    uint32_t biClrImportant;
-} BITMAPINFOHEADER;
-
-#pragma pack(pop)
-
-// Apply the kernel with zero padding and overlapping
-void apply_kernel_with_padding(uint8_t* image, uint8_t* output, int width, int height, float* kernel, int kernel_size) {
-    int offset = kernel_size / 2;
-
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            float sum_r = 0.0f;
-            float sum_g = 0.0f;
-            float sum_b = 0.0f;
-
-            for (int ky = 0; ky < kernel_size; ky++) {
-                for (int kx = 0; kx < kernel_size; kx++) {
-                    int pixel_x = x + kx - offset;
-                    int pixel_y = y + ky - offset;
-
-                    // Check bounds, apply zero padding
-                    if (pixel_x >= 0 && pixel_x < width && pixel_y >= 0 && pixel_y < height) {
-                        int idx = (pixel_y * width + pixel_x) * 3;
-                        sum_r += image[idx] * kernel[ky * kernel_size + kx];
-                        sum_g += image[idx + 1] * kernel[ky * kernel_size + kx];
-                        sum_b += image[idx + 2] * kernel[ky * kernel_size + kx];
-                    }
-                }
-            }
+    IMAGE pixels[2];        // Ping-pong buffers, halo + owned + halo both ways
+    IMAGE strip;            // Scratch for the columns next to a left or right halo
+    int max_halo_x;         // Halo columns kept left and right of the owned pixels
+    int max_halo_y;         // Halo rows kept before and after the owned pixels
+    int x0, y0;             // First column and row owned, in the image
+    int own_w, own_h;       // Columns and rows owned
+    int neighbours[3][3];   // Rank at [dy + 1][dx + 1], MPI_PROC_NULL past an image edge
+    MPI_Comm comm;          // Cartesian grid of ranks
+} BLOCK;
+
+// Pixel (x, y) of a block buffer, counted from the first owned pixel, negative in the halo
+unsigned char *block_pixel(const BLOCK *block, const IMAGE *pixels, int x, int y) {
+    return IMAGE_ROW(pixels, block->max_halo_y + y) + (size_t)(block->max_halo_x + x) * PIXEL_SIZE;
+}
+
+// Rows x columns pixels of a buffer with the given row size as an MPI type
+MPI_Datatype region_type(int rows, int columns, int row_padded) {
+    MPI_Datatype type;
+    MPI_Type_vector(rows, columns * PIXEL_SIZE, row_padded, MPI_UNSIGNED_CHAR, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
 
-            int idx = (y * width + x) * 3;
-            output[idx] = (uint8_t)(sum_r < 0 ? 0 : (sum_r > 255 ? 255 : sum_r));
-            output[idx + 1] = (uint8_t)(sum_g < 0 ? 0 : (sum_g > 255 ? 255 : sum_g));
-            output[idx + 2] = (uint8_t)(sum_b < 0 ? 0 : (sum_b > 255 ? 255 : sum_b));
+// One column of rows pixels of a buffer, spaced one pixel apart, so counts
+// and displacements of the collectives are in pixels
+MPI_Datatype column_type(int rows, int row_padded) {
+    MPI_Datatype column, type;
+    MPI_Type_vector(rows, PIXEL_SIZE, row_padded, MPI_UNSIGNED_CHAR, &column);
+    MPI_Type_create_resized(column, 0, PIXEL_SIZE, &type);
+    MPI_Type_commit(&type);
+    MPI_Type_free(&column);
+    return type;
+}
+
+// Pixels of buffer b holding the owned pixels and halos of the given size,
+// halos only where there is a neighbour. *top and *left are the halo rows
+// and columns in front of the owned pixels.
+IMAGE block_view(const BLOCK *block, int b, int halo_x, int halo_y, int *top, int *left) {
+    IMAGE view = block->pixels[b];
+    *top = block->neighbours[0][1] != MPI_PROC_NULL ? halo_y : 0;
+    *left = block->neighbours[1][0] != MPI_PROC_NULL ? halo_x : 0;
+    int bottom = block->neighbours[2][1] != MPI_PROC_NULL ? halo_y : 0;
+    int right = block->neighbours[1][2] != MPI_PROC_NULL ? halo_x : 0;
+    view.data = block_pixel(block, &block->pixels[b], -*left, -*top);
+    view.width = *left + block->own_w + right;
+    view.height = *top + block->own_h + bottom;
+    return view;
+}
+
+// Swap halos of buffer b with all eight neighbours without waiting, the
+// sixteen requests finish in MPI_Waitall. types[] gets the regions of a
+// corner, a top or bottom side and a left or right side, to be freed then.
+void block_exchange(BLOCK *block, int b, int halo_x, int halo_y, MPI_Request requests[16], MPI_Datatype types[3]) {
+    IMAGE *pixels = &block->pixels[b];
+    types[0] = region_type(halo_y, halo_x, pixels->row_padded);
+    types[1] = region_type(halo_y, block->own_w, pixels->row_padded);
+    types[2] = region_type(block->own_h, halo_x, pixels->row_padded);
+
+    int n = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            if (dy == 0 && dx == 0) continue;
+            MPI_Datatype type = types[dy == 0 ? 2 : (dx == 0 ? 1 : 0)];
+            int neighbour = block->neighbours[dy + 1][dx + 1];
+
+            // Owned pixels next to the neighbour, and the halo it fills
+            int send_x = dx > 0 ? block->own_w - halo_x : 0;
+            int send_y = dy > 0 ? block->own_h - halo_y : 0;
+            int recv_x = dx < 0 ? -halo_x : (dx > 0 ? block->own_w : 0);
+            int recv_y = dy < 0 ? -halo_y : (dy > 0 ? block->own_h : 0);
+
+            // Tags name the direction a message travels, a rank may be several neighbours at once
+            MPI_Irecv(block_pixel(block, pixels, recv_x, recv_y), 1, type, neighbour, (1 - dy) * 3 + (1 - dx),
+                      block->comm, &requests[n++]);
+            MPI_Isend(block_pixel(block, pixels, send_x, send_y), 1, type, neighbour, (dy + 1) * 3 + (dx + 1),
+                      block->comm, &requests[n++]);
         }
     }
 }
 
-// Function to load BMP image
-int load_bmp(const char* filename, uint8_t** image, int* width, int* height) {
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        printf("Error opening file!\n");
-        return -1;
+// Convolve columns [x_begin, x_end) of rows [y_begin, y_end) of a block view
+// into dst through the strip buffer, reading halo_x columns either side
+void block_columns(BLOCK *block, const IMAGE *src, IMAGE *dst, int x_begin, int x_end, int y_begin, int y_end,
+                   int halo_x, const KERNEL *conv_kernel, const CONV_OPTIONS *options) {
+    int from = x_begin - halo_x > 0 ? x_begin - halo_x : 0;
+    int to = x_end + halo_x < src->width ? x_end + halo_x : src->width;
+
+    IMAGE narrow = *src, strip = block->strip;
+    narrow.data = IMAGE_ROW(src, 0) + (size_t)from * PIXEL_SIZE;
+    narrow.width = strip.width = to - from;
+    strip.height = src->height;
+    if (!conv_pipeline_range(&narrow, &strip, conv_kernel, 1, options, y_begin, y_end)) {
+        MPI_Abort(MPI_COMM_WORLD, -1);
     }
 
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
+    for (int y = y_begin; y < y_end; y++) {
+        memcpy(IMAGE_ROW(dst, y) + (size_t)x_begin * PIXEL_SIZE,
+               IMAGE_ROW(&strip, y) + (size_t)(x_begin - from) * PIXEL_SIZE, (size_t)(x_end - x_begin) * PIXEL_SIZE);
+    }
+}
 
-    fread(&fileHeader, sizeof(BITMAPFILEHEADER), 1, file);
-    fread(&infoHeader, sizeof(BITMAPINFOHEADER), 1, file);
+// Run one kernel over the owned pixels of buffer b into buffer 1 - b. Rows
+// at least a kernel radius inside the block only read owned rows, so they
+// are convolved while the halos are on their way, the rest once they arrive.
+// The owned columns next to a left or right halo are redone at the end.
+void block_convolve(BLOCK *block, int b, const KERNEL *conv_kernel, const CONV_OPTIONS *options) {
+    int halo_x = conv_kernel->width / 2;
+    int halo_y = conv_kernel->height / 2;
+    MPI_Request requests[16];
+    MPI_Datatype types[3];
+    block_exchange(block, b, halo_x, halo_y, requests, types);
+
+    // The owned pixels alone, with the image edge where there is no neighbour.
+    // The job keeps pointers to both, so they stay untouched until it ends.
+    IMAGE inner_src = block->pixels[b], inner_dst = block->pixels[1 - b];
+    inner_src.data = block_pixel(block, &block->pixels[b], 0, 0);
+    inner_dst.data = block_pixel(block, &block->pixels[1 - b], 0, 0);
+    inner_src.width = inner_dst.width = block->own_w;
+    inner_src.height = inner_dst.height = block->own_h;
+
+    int inner_start = block->neighbours[0][1] != MPI_PROC_NULL ? halo_y : 0;
+    int inner_end = block->own_h - (block->neighbours[2][1] != MPI_PROC_NULL ? halo_y : 0);
+    if (inner_end < inner_start) inner_end = inner_start;
+
+    // The pool convolves the inner rows while this thread, the only one
+    // calling MPI, waits for the halos
+    CONV_JOB job;
+    if (!conv_pipeline_range_submit(&inner_src, &inner_dst, conv_kernel, 1, options, inner_start, inner_end, &job)) {
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    MPI_Waitall(16, requests, MPI_STATUSES_IGNORE);
+    for (int i = 0; i < 3; i++) {
+        MPI_Type_free(&types[i]);
+    }
 
-    *width = infoHeader.biWidth;
-    *height = infoHeader.biHeight;
+    int top, left;
+    IMAGE src = block_view(block, b, halo_x, halo_y, &top, &left);
+    IMAGE dst = block_view(block, 1 - b, halo_x, halo_y, &top, &left);
+    if (!conv_pipeline_range(&src, &dst, conv_kernel, 1, options, top, top + inner_start) ||
+        !conv_pipeline_range(&src, &dst, conv_kernel, 1, options, top + inner_end, top + block->own_h)) {
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (!conv_image_wait(&job)) {
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
 
-    int size = 3 * (*width) * (*height);
-    *image = (uint8_t*)malloc(size);
+    // The inner rows saw the block edge where the halo columns are
+    if (block->neighbours[1][0] != MPI_PROC_NULL) {
+        block_columns(block, &src, &dst, left, left + halo_x, top + inner_start, top + inner_end, halo_x,
+                      conv_kernel, options);
+    }
+    if (block->neighbours[1][2] != MPI_PROC_NULL) {
+        block_columns(block, &src, &dst, left + block->own_w - halo_x, left + block->own_w, top + inner_start,
+                      top + inner_end, halo_x, conv_kernel, options);
+    }
+}
 
-    fseek(file, fileHeader.bfOffBits, SEEK_SET);
-    fread(*image, size, 1, file);
-    fclose(file);
+// Read the headers of a BMP file on rank 0 and share its size and layout
+// with every rank. offset is where the first pixel row starts in the file.
+void read_bmp_layout(const char *filename, int rank, int *width, int *height, int *top_down, long long *offset) {
+    int layout[3];
+    if (rank == 0) {
+        FILE *file = fopen(filename, "rb");
+        if (!file) {
+            printf("Error: Failed to open BMP file.\n");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        if (!bmp_read_header(file, &layout[0], &layout[1], &layout[2])) {
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        *offset = ftell(file);
 
-    return 0;
+        // The file must hold every row, padding included
+        fseek(file, 0, SEEK_END);
+        if (ftell(file) < *offset + (long long)bmp_row_size(layout[0]) * layout[1]) {
+            printf("Error: BMP file is truncated.\n");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        fclose(file);
+    }
+    MPI_Bcast(layout, 3, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(offset, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    *width = layout[0];
+    *height = layout[1];
+    *top_down = layout[2];
+}
+
+// Show only the owned pixels of a block in a BMP file, seen as an array of
+// rows of row_padded bytes from offset, with the block at file row file_row
+void set_block_view(MPI_File file, const BLOCK *block, long long offset, int width, int height, int file_row) {
+    int sizes[2] = { height, bmp_row_size(width) };
+    int subsizes[2] = { block->own_h, block->own_w * PIXEL_SIZE };
+    int starts[2] = { file_row, block->x0 * PIXEL_SIZE };
+    MPI_Datatype filetype;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_UNSIGNED_CHAR, &filetype);
+    MPI_Type_commit(&filetype);
+    MPI_File_set_view(file, (MPI_Offset)offset, MPI_UNSIGNED_CHAR, filetype, "native", MPI_INFO_NULL);
+    MPI_Type_free(&filetype);
 }
 
-// Function to save BMP image
-int save_bmp(const char* filename, uint8_t* image, int width, int height) {
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
-        printf("Error opening file!\n");
-        return -1;
+// Read the owned pixels of every block from a BMP file into buffer 0, all
+// ranks at once. A top-down file stores the rows backwards, so the block is
+// read as one piece and its rows are turned around.
+void read_block_all(const char *filename, BLOCK *block, long long offset, int width, int height, int top_down) {
+    MPI_File file;
+    if (MPI_File_open(block->comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        printf("Error: Failed to open BMP file.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
     }
 
-    BITMAPFILEHEADER fileHeader = {0x4D42, 0, 0, 0, 54}; // 'BM' header
-    BITMAPINFOHEADER infoHeader = {40, width, height, 1, 24, 0, 0, 0, 0, 0};
+    IMAGE *pixels = &block->pixels[0];
+    set_block_view(file, block, offset, width, height, top_down ? height - block->y0 - block->own_h : block->y0);
+    MPI_Datatype memtype = region_type(block->own_h, block->own_w, pixels->row_padded);
+    if (MPI_File_read_all(file, block_pixel(block, pixels, 0, 0), 1, memtype, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+        printf("Error: Failed to read BMP file.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    MPI_Type_free(&memtype);
+    MPI_File_close(&file);
+
+    if (top_down) {
+        size_t bytes = (size_t)block->own_w * PIXEL_SIZE;
+        unsigned char *row = (unsigned char*)malloc(bytes);
+        if (!row) {
+            printf("Error: Failed to allocate memory for row.\n");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        for (int a = 0, b = block->own_h - 1; a < b; a++, b--) {
+            memcpy(row, block_pixel(block, pixels, 0, a), bytes);
+            memcpy(block_pixel(block, pixels, 0, a), block_pixel(block, pixels, 0, b), bytes);
+            memcpy(block_pixel(block, pixels, 0, b), row, bytes);
+        }
+        free(row);
+    }
+}
 
-    int size = 3 * width * height;
-    fileHeader.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + size;
-    infoHeader.biSizeImage = size;
+// Write the owned pixels of every block from buffer b into a new bottom-up
+// BMP file, all ranks at once, after rank 0 has written the headers
+void write_block_all(const char *filename, BLOCK *block, int b, int rank, int width, int height) {
+    if (rank == 0) {
+        FILE *header = fopen(filename, "wb");
+        if (!header || !bmp_write_header(header, width, height, 0) || fclose(header) != 0) {
+            printf("Error: Failed to save BMP file.\n");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
+    MPI_Barrier(block->comm);
 
-    fwrite(&fileHeader, sizeof(BITMAPFILEHEADER), 1, file);
-    fwrite(&infoHeader, sizeof(BITMAPINFOHEADER), 1, file);
+    MPI_File file;
+    if (MPI_File_open(block->comm, filename, MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+        printf("Error: Failed to save BMP file.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
 
-    fwrite(image, size, 1, file);
-    fclose(file);
+    // Row padding is never written, sizing the file makes it read as zeros
+    long long offset = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+    MPI_File_set_size(file, (MPI_Offset)offset + (MPI_Offset)bmp_row_size(width) * height);
 
-    return 0;
+    IMAGE *pixels = &block->pixels[b];
+    set_block_view(file, block, offset, width, height, block->y0);
+    MPI_Datatype memtype = region_type(block->own_h, block->own_w, pixels->row_padded);
+    if (MPI_File_write_all(file, block_pixel(block, pixels, 0, 0), 1, memtype, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+        printf("Error: Failed to write BMP file.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    MPI_Type_free(&memtype);
+    MPI_File_close(&file);
 }
 
-// Define the kernel (e.g., a 3x3 averaging kernel)
-float kernel[3][3] = {
-    {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f},
-    {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f},
-    {1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f}
-};
-
 int main(int argc, char** argv) {
-    MPI_Init(&argc, &argv);
+    // Worker threads never call MPI, only the main thread does
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 
     int rank, size;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+    if (provided < MPI_THREAD_FUNNELED && backend != BACKEND_SERIAL) {
+        if (rank == 0) printf("Warning: MPI has no thread support, running one thread per rank.\n");
+        backend = BACKEND_SERIAL;
+    }
+    if (num_threads == 0 && getenv("OMP_NUM_THREADS")) {
+        num_threads = atoi(getenv("OMP_NUM_THREADS"));
+    }
+
     const char* input_image = "lena.bmp";
     const char* output_image = "lenaout.bmp";
 
-    uint8_t* image = NULL;
-    int width, height;
+    IMAGE image;
+    int width, height, top_down;
+    long long offset;
 
     struct timeval  tv1, tv2;
 
     printf("Rank %d out of %d\n", rank, size);
 
-    // Master process (rank 0) loads the image
-    if (rank == 0) {
-        if (load_bmp(input_image, &image, &width, &height) != 0) {
+    // Master process (rank 0) loads the image, or only its headers with MPI-IO
+    if (mpi_io) {
+        read_bmp_layout(input_image, rank, &width, &height, &top_down, &offset);
+    } else if (rank == 0) {
+        if (!load_bmp(input_image, &image)) {
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        width = image.width;
+        height = image.height;
+    }
+
+    // Each argument is one pass of any odd size, a file or the kernel itself (see kernel_read)
+    int num_passes = argc > 1 ? argc - 1 : 1;
+    KERNEL *conv_kernels = (KERNEL*)malloc(sizeof(KERNEL) * num_passes);
+    if (!conv_kernels) {
+        printf("Error: Failed to allocate memory for kernels.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    int max_x = 0, max_y = 0, sum_x = 0, sum_y = 0;
+    for (int i = 0; i < num_passes; i++) {
+        int kernel_ok = argc > 1 ? kernel_load(&conv_kernels[i], argv[i + 1])
+                                 : kernel_init(&conv_kernels[i], 3, 3, &kernel[0][0]);
+        if (!kernel_ok) {
             MPI_Abort(MPI_COMM_WORLD, -1);
         }
+        int halo_x = conv_kernels[i].width / 2, halo_y = conv_kernels[i].height / 2;
+        max_x = halo_x > max_x ? halo_x : max_x;
+        max_y = halo_y > max_y ? halo_y : max_y;
+        sum_x += halo_x;
+        sum_y += halo_y;
     }
 
     // Broadcast image dimensions to all processes
-    MPI_Bcast(&width, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&height, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-    // Calculate the chunk size for each process (divide the height of the image)
-    int chunk_height = height / size;
-    int remainder = height % size;
-
-    // Add overlap to the chunk
-    int overlap = 6;
-    int start_row = rank * chunk_height + (rank < remainder ? rank : remainder);
-    int end_row = (rank + 1) * chunk_height + (rank + 1 < remainder ? rank + 1 : remainder);
-
-    // Allocate memory for the image chunk with overlap (add one row above and below)
-    uint8_t* chunk = (uint8_t*)malloc(3 * width * (end_row - start_row + (2 * overlap)));
-
-    // Master process sends image chunks to worker processes
-    if (rank == 0)
-    {
-        for (int i = 1; i < size; i++) {
-            int start = i * chunk_height + (i < remainder ? i : remainder) - overlap;
-            int end = (i + 1) * chunk_height + (i + 1 < remainder ? i + 1 : remainder) + overlap;
-
-            // Send chunk with overlap rows
-            MPI_Send(&image[(start * width * 3)], 3 * width * (end - start), MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
+    if (!mpi_io) {
+        MPI_Bcast(&width, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        MPI_Bcast(&height, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+
+    int row_padded = bmp_row_size(width);
+
+    // Halos come from the neighbours only, so every block must hold them
+    int wrap = border == BORDER_WRAP;
+    int dims[2];
+    if (!choose_grid(width, height, size, max_x, max_y, sum_x, sum_y, wrap, dims)) {
+        if (rank == 0) printf("Error: No grid of %d ranks gives blocks of at least %d x %d pixels, use fewer ranks.\n",
+                              size, max_x, max_y);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (rank == 0) printf("Grid of %d x %d blocks\n", dims[1], dims[0]);
+
+    // Ranks keep their numbers, so rank 0 still holds the image
+    BLOCK block;
+    int periods[2] = { wrap, wrap };
+    int coords[2];
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &block.comm);
+    MPI_Cart_coords(block.comm, rank, 2, coords);
+
+    int end_x, end_y;
+    split_range(height, dims[0], coords[0], &block.y0, &end_y);
+    split_range(width, dims[1], coords[1], &block.x0, &end_x);
+    block.own_w = end_x - block.x0;
+    block.own_h = end_y - block.y0;
+    block.max_halo_x = max_x;
+    block.max_halo_y = max_y;
+
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            int at[2] = { coords[0] + dy, coords[1] + dx };
+            if (wrap) {
+                at[0] = (at[0] + dims[0]) % dims[0];
+                at[1] = (at[1] + dims[1]) % dims[1];
+            }
+            if (at[0] < 0 || at[0] >= dims[0] || at[1] < 0 || at[1] >= dims[1]) {
+                block.neighbours[dy + 1][dx + 1] = MPI_PROC_NULL;
+            } else {
+                MPI_Cart_rank(block.comm, at, &block.neighbours[dy + 1][dx + 1]);
+            }
         }
+    }
 
-        // Take start time
-        gettimeofday(&tv1, NULL);
-        //mpiexec -np 18 Project2.exe
+    if (!image_alloc(&block.pixels[0], block.own_w + 2 * max_x, block.own_h + 2 * max_y) ||
+        !image_alloc(&block.pixels[1], block.own_w + 2 * max_x, block.own_h + 2 * max_y) ||
+        !image_alloc(&block.strip, max_x > 0 ? 3 * max_x : 1, block.own_h + 2 * max_y)) {
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
 
-        // Process the master chunk with overlap
-        apply_kernel_with_padding(&image[start_row * width * 3], chunk, width, end_row - start_row + overlap, (float*)kernel, 3);
-    } else
-    {
-        // Worker processes receive their image chunk
-        MPI_Recv(chunk, 3 * width * (end_row - start_row + (2 * overlap)), MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    // Ranks of one grid row, numbered by column, and of one grid column, numbered by row
+    MPI_Comm row_comm, column_comm;
+    int keep_columns[2] = { 0, 1 }, keep_rows[2] = { 1, 0 };
+    MPI_Cart_sub(block.comm, keep_columns, &row_comm);
+    MPI_Cart_sub(block.comm, keep_rows, &column_comm);
+
+    // Rows of every grid row and columns of every grid column, for the collectives
+    int *row_counts = (int*)malloc(sizeof(int) * dims[0]);
+    int *row_displs = (int*)malloc(sizeof(int) * dims[0]);
+    int *column_counts = (int*)malloc(sizeof(int) * dims[1]);
+    int *column_displs = (int*)malloc(sizeof(int) * dims[1]);
+    if (!row_counts || !row_displs || !column_counts || !column_displs) {
+        printf("Error: Failed to allocate memory for block counts.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    for (int i = 0; i < dims[0]; i++) {
+        int start, end;
+        split_range(height, dims[0], i, &start, &end);
+        row_counts[i] = end - start;
+        row_displs[i] = start;
+    }
+    for (int i = 0; i < dims[1]; i++) {
+        int start, end;
+        split_range(width, dims[1], i, &start, &end);
+        column_counts[i] = end - start;
+        column_displs[i] = start;
+    }
+
+    // One BMP row as an MPI type, so counts are in rows and never overflow an int of bytes
+    MPI_Datatype row_type;
+    MPI_Type_contiguous(row_padded, MPI_UNSIGNED_CHAR, &row_type);
+    MPI_Type_commit(&row_type);
+
+    // Without MPI-IO the first rank of every grid row holds the full rows of
+    // its grid row between the two collectives. The master's are in the image.
+    IMAGE band;
+    band.data = NULL;
+    if (!mpi_io && coords[1] == 0) {
+        if (rank == 0) {
+            band = image;
+            band.data = IMAGE_ROW(&image, block.y0);
+            band.height = block.own_h;
+        } else if (!image_alloc(&band, width, block.own_h)) {
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
 
+    // Pixel columns of the band and of the block
+    MPI_Datatype band_column = column_type(block.own_h, row_padded);
+    MPI_Datatype block_column = column_type(block.own_h, block.pixels[0].row_padded);
+
+    // Every rank receives the pixels it owns, the halos come from the
+    // neighbours: full rows go down the first grid column, then every grid
+    // row splits them into blocks. With MPI-IO every rank reads its block.
+    if (mpi_io) {
+        read_block_all(input_image, &block, offset, width, height, top_down);
+    } else {
+        if (coords[1] == 0) {
+            if (rank == 0) {
+                MPI_Scatterv(image.data, row_counts, row_displs, row_type, MPI_IN_PLACE, 0, row_type, 0,
+                             column_comm);
+            } else {
+                MPI_Scatterv(NULL, NULL, NULL, row_type, band.data, block.own_h, row_type, 0, column_comm);
+            }
+        }
+        MPI_Scatterv(band.data, column_counts, column_displs, band_column,
+                     block_pixel(&block, &block.pixels[0], 0, 0), block.own_w, block_column, 0, row_comm);
+    }
+
+    // Take start time
+    if (rank == 0) {
+        gettimeofday(&tv1, NULL);
+        //mpiexec -np 18 Project2.exe
+    }
 
-        // Apply the kernel to the received chunk
-        apply_kernel_with_padding(chunk, chunk, width, end_row - start_row + (2 * overlap), (float*)kernel, 3);
+    CONV_OPTIONS options;
+    conv_default_options(&options);
+    options.precision = PRECISION_FLOAT;  // PRECISION_FIXED gives the same bytes on every backend
+    options.border = border;
+    options.backend = backend;
+    options.num_threads = num_threads;
+
+    // Apply the kernels in turn, each pass swaps halos with the neighbours
+    int b = 0;
+    for (int i = 0; i < num_passes; i++) {
+        block_convolve(&block, b, &conv_kernels[i], &options);
+        b = 1 - b;
     }
 
-    // Gather all chunks back to the master node
-    uint8_t* result_image = NULL;
+    // Take end time
     if (rank == 0) {
-        // Take end time
         gettimeofday(&tv2,NULL);
 
         printf ("Elapsed time = %f seconds\n",
             (double) (tv2.tv_usec - tv1.tv_usec) / 1000000 +
             (double) (tv2.tv_sec - tv1.tv_sec));
+    }
 
-        result_image = (uint8_t*)malloc(3 * width * height);
-
-        /*for(int i = 0; i < 3 * width * height; i++)
-        {
-            result_image[i] = 250;
-        }*/
-
-        memcpy(result_image + (start_row * width * 3), chunk, 3 * width * (end_row - start_row));
-
-        // Gather results from all other processes
-        for (int i = 1; i < size; i++) {
-            int start = i * chunk_height + (i < remainder ? i : remainder);
-            int end = (i + 1) * chunk_height + (i + 1 < remainder ? i + 1 : remainder);
-
-            MPI_Recv(&result_image[start * width * 3], 3 * width * (end - start), MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    // Every rank writes its own block, or the blocks go back the way they
+    // came into the master's image
+    if (mpi_io) {
+        write_block_all(output_image, &block, b, rank, width, height);
+    } else {
+        MPI_Gatherv(block_pixel(&block, &block.pixels[b], 0, 0), block.own_w, block_column,
+                    band.data, column_counts, column_displs, band_column, 0, row_comm);
+        if (coords[1] == 0) {
+            if (rank == 0) {
+                MPI_Gatherv(MPI_IN_PLACE, 0, row_type, image.data, row_counts, row_displs, row_type, 0,
+                            column_comm);
+            } else {
+                MPI_Gatherv(band.data, block.own_h, row_type, NULL, NULL, NULL, row_type, 0, column_comm);
+            }
         }
 
         // Save the resulting image
-        save_bmp(output_image, result_image, width, height);
-    } else {
-        // Send the chunk back to the master
-        MPI_Send(chunk + (overlap * 3 * width), 3 * width * (end_row - start_row), MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
+        if (rank == 0) {
+            if (!save_bmp(output_image, &image)) {
+                MPI_Abort(MPI_COMM_WORLD, -1);
+            }
+            image_free(&image);
+        }
     }
 
     // Clean up
-    free(chunk);
-    if (rank == 0) {
-        free(image);
-        free(result_image);
+    if (band.data && rank != 0) image_free(&band);
+    MPI_Type_free(&band_column);
+    MPI_Type_free(&block_column);
+    MPI_Type_free(&row_type);
+    free(row_counts);
+    free(row_displs);
+    free(column_counts);
+    free(column_displs);
+    MPI_Comm_free(&row_comm);
+    MPI_Comm_free(&column_comm);
+    MPI_Comm_free(&block.comm);
+    image_free(&block.pixels[0]);
+    image_free(&block.pixels[1]);
+    image_free(&block.strip);
+    for (int i = 0; i < num_passes; i++) {
+        kernel_free(&conv_kernels[i]);
     }
+    free(conv_kernels);
 
     MPI_Finalize();
     return 0;